@@ -9,34 +9,14 @@ then
     echo $1 not found in demos/903algol
     exit
 fi
-rm -f .reader .punch .ascii .save .plot.png .translate
-#echo loading Algol
-cp bin/903algol/alg16klg_ajh_store .store
+rm -f .reader .punch .ascii .plot.png .translate
 #echo convert input tape
 ./to900text demos/903algol/$1.txt
-#echo run translator in library mode
-./emu900 -j=12 $2 >.translate
-cp .reader .save
-if [ $? != 0 ]
-then exit $?
-fi
-cat .translate
+#echo translate, scan library and run interpreter
+./emu900 -job=jobs/903algolajh.job $2
 grep --silent "^FAIL$" .translate
 if [ $? != 0 ]
 then
-    #echo scan library
-    grep --silent "^FIRST  NEXT" .translate
-    if [ $? != 0 ]
-    then
-        ./emu900 -j=9 $2 -reader=bin/903algol/algol_tape3_iss7_plotting
-        #echo library scan completed $?
-        if [ $? != 0 ]
-        then exit $?
-        fi
-    fi
-    #echo run interpreter
-    ./emu900 -j=10 $2 -reader=.save
-    #echo process output
     touch .punch
     ./from900text
     if  [ ! -s .ascii ]
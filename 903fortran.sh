@@ -11,22 +11,11 @@ then
 fi
 rm -f .reader .punch .ascii .translate
 echo loading Fortran
-cp bin/903fortran.fort16klg_iss5_store .store
 echo convert input tape $1
 ./to900text demos/903fortran/$1.txt
-echo read program
-./emu900 -j=8 $2 >.translate
-if [ $? != 0 ]
-then exit $?
-fi
+./emu900 -job=jobs/903fortran.job $2
 if [ ! -s .translate ]
 then
-    echo signal program complete
-    ./emu900 -j=10
-    echo
-    echo run program
-    ./emu900 -j=11
-    echo
     echo
     touch .punch
     ./from900text
@@ -9,34 +9,14 @@ then
     echo $1 not found in demos/903fortran
     exit
 fi
-rm -rf .reader .punch .reverse .save .ascii .linker
-#echo load compiler
-cp bin/905fortran/905fortran_iss6_store .store
+rm -rf .reader .punch .ascii .linker
 #echo convert input tape $1
 ./to900text demos/905fortran/$1.txt
-#echo compile program
-./emu900 -j=16 -ttyin=bin/905fortran/O0R
-echo
-# save paper tape in case contains data
-mv .reader .save
-#echo reverse output
-./reverse
-#echo load loader
-cp bin/905fortran/loader_iss3_store .store
-#echo load program binary
-./emu900 -j=16 -reader=.reverse -ttyin=bin/905fortran/O20L >.linker
+#echo compile, load and run program
+./emu900 -job=jobs/905fortran.job
 grep --silent "*LDR 000000" .linker
 if [ $? != 0 ]
 then
-    echo
-    ./emu900 -j=16 -reader=bin/905fortran/905fortlib -ttyin=bin/905fortran/O3L
-    #echo complete load and run
-    echo
-    # clear punch
-    rm .punch
-    touch .punch
-    ./emu900 -j=16 -reader=.save -ttyin=bin/905fortran/MM
-    echo
     #echo check for punch output
     touch .ascii
     ./from900text
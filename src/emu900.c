@@ -10,11 +10,17 @@
 
 // Pre-requisites:
 //    LIBOPT for command line decoding
-//    LIBPNG for plotter output
+//    ZLIB and POSIX threads for plotter output
 
 // Usage: emu900 [-d?] [-reader=file] [-punch=file] [-ttyin=file] [-plot=file]
-//        [-store=file] [-d|-dfile] [-a|-abandon=integer] [-h|-height=integer]
-//        [-j|-jump=integer] [-m|-monitor=address] [-p|-Pen=integer]
+//        [-store=file] [-binary] [-job=file] [-batch=file] [-workers=integer]
+//        [-serve=socket] [-client=socket] [-profile=file]
+//        [-tracefile=file] [-history=integer] [-checkpoint-every=integer]
+//        [-restore=file] [-record=integer] [-whowrote=address] [-rewind=integer]
+//        [-break=addresses] [-keeptape] [-buffer=integer] [-vector=file]
+//        [-plot-every=integer] [-pnglevel=integer] [-pngfilter=name]
+//        [-engine=name] [-d|-dfile] [-a|-abandon=integer] [-h|-height=integer]
+//        [-j|-jump=integer] [-m|-monitor=addresses] [-p|-Pen=integer]
 //        [-r|-rtrace=integer] [-s|-start=address] [-t|-trace=integer]
 //        [-w|-width=integer] [-v|-verbose=integer] [-?|--help] [--usage]
 
@@ -35,10 +41,20 @@
 // file, unless there have been catastrophic errors. This is to simulate
 // retention of data in core store between entry points.
 
+// The store file may be either text, a list of decimal integers, or binary, a header
+// followed by the words in host byte order.  A binary image is recognised when read
+// and written back in binary; the -binary argument converts a text image to binary
+// when the store is written out.  Binary images are much quicker to load and save.
+// The store file is only rewritten if the store has changed, and then by writing a
+// new file, flushing it to disk, and renaming it over the old one.
+
 // Paper tape input from the file .reader unless overridden by the -reader argument on
-// the command line. At the end it copies any unconsumed  input back to the file
+// the command line. At the end it copies all the unconsumed input back to the file
 // overwriting previous content, unless there have been catastrophic errors. This is to
-// emulate leaving a tape in the reader between successive runs.
+// emulate leaving a tape in the reader between successive runs.  With -keeptape the
+// input file is left as it is and instead the offset reached is recorded in a small
+// file named after it with ".offset" added.  A later run with -keeptape carries on
+// reading from that offset, provided the input file has not changed meanwhile.
 
 // The input file should be a raw byte stream representing eight bit paper tape
 // codes, either binary of one of the Elliott telecodes.  There is a companion
@@ -56,13 +72,48 @@
 // There is a limit of output characters on paper tape or teletype roughly equal to a
 // reel of paper tape (120,000 characters).
 
+// Teletype and punch output is buffered, -buffer bytes at a time (by default 65536,
+// 0 for none), and the teletype is flushed before each diagnostic message.
+
 // Plotter output is sent to the file .plot.png unless overridden by a -plot argument.
-// The output is in a PHG format.
+// The output is in a PHG format, one bit per pixel.  The paper is held in memory as
+// square tiles of one bit per pixel that are only allocated when the pen first
+// marks them, so large or mostly blank sheets cost little.
+
+// The PNG is compressed in bands of rows on one thread per processor.  -pnglevel
+// sets the zlib compression level (0-9, by default 6) and -pngfilter the PNG filter
+// applied to every row (none, sub, up, average or paeth, by default none).
+
+// -plot-every writes the plotter output so far (PNG and any -vector file) every so
+// many plotter steps, and it is also written at each -checkpoint-every checkpoint,
+// so a long plotting run can be watched and a crash or interrupt loses little.  The
+// PNG is replaced atomically; the vector file is extended in place, keeping it
+// complete, and the strokes written are then forgotten.
+
+// -vector records the plotter's movements as pen strokes, merging runs of steps in
+// the same direction, instead of inking the paper at every step.  The strokes are
+// drawn onto the paper only when the PNG is written (or a checkpoint taken) and are
+// written to the named file as SVG if it ends .svg and as HPGL otherwise.  A
+// checkpoint first writes out the strokes so far, and after -restore the file is cut
+// back to where it was then and strokes are appended from there.
 
 // The size of the plotting area can be set using the -width and -height command line
 // arguments.  These set the size in plotter steps.  The size of the pen nib can be
 // set using the -pen command line argument.  The default is 3 steps (0.3mm).
 
+// The -job argument runs a sequence of stages listed in a job file, e.g., translate,
+// scan library and run, in one process, keeping the store and paper tapes in memory
+// between stages.  See runJob() for the commands.  The jobs directory holds job files
+// for the language systems.
+
+// The -batch argument runs a batch of independent runs listed in a manifest file in
+// parallel, up to -workers at once (by default one per processor), and prints a
+// summary.  See runBatch() for the manifest format.
+
+// The -serve argument runs a server for jobs sent by emu900 -client over a Unix
+// socket.  The server keeps the store images and library tapes jobs use in memory.
+// See serve() for details.
+
 // By default the simulator jumps to 8181 to start execution, unless overriden by
 // -jump argument on the command line.  The jump address can be in the range 0-8191.
 
@@ -73,25 +124,81 @@
 // A smaller limit on maximum number of instructions to be executed can be set using
 // the -abandon command line argument.
 
-// A specific store location can be monitored for be written to using the -monitor
-// command line argument.  The address must not exceed the available store size.
+// Store locations can be monitored for being changed using the -monitor command line
+// argument, which takes a list of addresses and ranges, e.g., -m=100,1^0000-1^0777,
+// and can be given more than once.  Each change is reported with the instruction
+// making it.  -break takes addresses in the same form and stops the run with exit
+// code 32 before an instruction at any of them is executed, saving the machine
+// state in .checkpoint so the run can be carried on with -restore.  Addresses must
+// not exceed the available store size.  When neither is given they cost nothing.
 
 // The -start argument starts tracing from the specified location. -trace turns on
 // tracing after the specified number of instructions have been executed. -rtrace is
 // like -start but stops tracing after a further 1000 instructions have been executed.
 // -trace overrides -trace.  -trace/-rtrace and -start can both be specified and tracing
 // will start from whichever condition occurs first.  The address part of -start must not
-// exceed the available store size.
-
-// Addresses for the -start and -monitor arguments can be written in the form m^a where
-// m represents an 8K store module number and a an address within the selected store
-// module.
+// exceed the available store size.  Runs without any tracing or monitoring options
+// use a faster execution loop that omits these checks.  With -tracefile instructions
+// that would be traced are instead recorded in a compact binary form in the named
+// file, which is very much quicker.  The program trace900 prints a binary trace in
+// the same form as the text trace.  Other diagnostics still go to the usual place.
+
+// Whatever the options the last -history instructions executed (by default 4096)
+// are remembered and, if the run fails or reaches its instruction limit, written
+// to .history in the same binary form as -tracefile for printing with trace900.
+// Only the address and instruction are remembered, packed with the instruction
+// count into one word, so the registers are shown for the last instruction alone.
+// Remembering costs a few per cent of the speed of the fast execution loops and
+// -history=0 turns it off.  Instructions run as native code by the jit engine
+// are not remembered individually, showing as gaps in the instruction counts.
+
+// -checkpoint-every saves the complete state of the machine in .checkpoint every so
+// many instructions: registers, store, instruction count and time, how far the
+// reader, punch and teletype files have got and the plotter.  -restore carries on a
+// run from such a file exactly as if it had not stopped, so a long run can resume
+// after the host restarts, or a failure late in a run can be investigated with
+// tracing from a checkpoint just before it.  The same peripheral files as for the
+// original run must be given.  -restore cannot be used with -job, -batch or -serve.
+
+// -record turns on record mode for looking back over a run once it has ended.
+// Every write to the store is logged in memory with the instruction making it and
+// the previous contents, and a snapshot of the machine is kept every so many
+// instructions.  At the end of the run -whowrote lists the last writes to the given
+// location with the instructions that made them, and -rewind writes to .checkpoint
+// the snapshot taken at or before the given instruction count.  Running from that
+// with -restore, tracing and -abandon then steps up to exactly the instruction of
+// interest.  Given -rewind, -whowrote lists writes up to that instruction.  The
+// memory used grows with the length of the run so -record suits runs of up to some
+// hundreds of millions of instructions.  The jit engine reverts to the block engine.
+// Note .reader is replaced by the unread part of the tape at the end of a run, so
+// restoring needs the tape as it was, for example by using -reader or -keeptape.
+
+// The -engine argument selects how instructions are dispatched: "switch" (the default)
+// uses a switch on the function code, "threaded" uses direct threaded code via
+// GCC labels as values and "block" translates straight-line runs of instructions
+// into cached basic blocks of micro-ops, each naming its handler, that execute
+// without fetching, decoding or dispatching, going from block to block directly.
+// All give identical results.  The block engine fast forwards idle loops counting
+// A up to zero by adding constants, advancing the instruction count and time as if
+// they had been run.
+// The block engine reverts to the switch engine while tracing.
+// When built with "make JIT=1" on an x86-64 host "jit" is also available: this is
+// the block engine with frequently executed blocks translated into native code.
+
+// The -profile argument counts the executions, operand reads and writes of every
+// store address and at the end of the run writes a report to the named file listing
+// the hot spots, the most read and written words and every word used with its
+// contents shown as an instruction.  Profiling uses the instrumented execution loop.
+
+// Addresses for the -start, -monitor and -break arguments can be written in the form
+// m^a where m represents an 8K store module number and a an address within the
+// selected store module.
 
 // The program exits with an exit code indicating the reason for completion,
 // e.g., 0 = dynamic stop, 1 = run out of paper tape input, etc.2 = run out of
-// teletype input, 3 = reached execution limit, 255 = catastropic error.  The
-// contents of the store,reader, punch and plotter files are undefined after a
-// catastrophic error.
+// teletype input, 3 = reached execution limit, 32 = breakpoint, 255 = catastropic
+// error.  The contents of the store,reader, punch and plotter files are undefined
+// after a catastrophic error.
 
 /**********************************************************/
 /*                     HEADER FILES                       */
@@ -101,10 +208,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <signal.h>
-#include <png.h>
+#include <setjmp.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <zlib.h>
 #include <popt.h>
+#ifdef JIT
+#ifndef __x86_64__
+#error "JIT translation requires an x86-64 host"
+#endif
+#endif
 
 
 /**********************************************************/
@@ -120,6 +245,8 @@
 #define STORE_FILE ".store"    // store image - n.b., ERR_FOPEN_STORE_FILE
 #define PLOT_FILE  ".plot.png" // plotter output as png file
 #define STOP_FILE  ".stop"     // dynamic stop address
+#define BATCH_OUTPUT ".output" // teletype and diagnostic output of batch run
+#define PROFILE_HOT 100        // addresses listed in each profile ranking
 
 #define USAGE "Usage: emu900[-adjmrstv] <reader file> <punch file> <teletype file>\n"
 #define ERR_FOPEN_DIAG_LOGFILE  "Cannot open log file"
@@ -141,11 +268,13 @@
 #define EXIT_TTYSTOP       4
 #define EXIT_LIMITSTOP     8
 #define EXIT_PUNSTOP      16
+#define EXIT_BREAKSTOP    32
 
 /* Useful constants */
 #define BIT19       01000000
 #define MASK18       0777777
 #define BIT18       00400000
+#define BIT17       00200000
 #define MASK16      00177777
 #define ADDR_MASK       8191
 #define MOD_MASK    00160000
@@ -166,6 +295,15 @@
 #define PAPER_WIDTH  3600  // 0.1 mm steps - 34cm max on B-L plotter
 #define PAPER_HEIGHT 3600  // 0.1 mm stemps
 #define PEN_SIZE        4  // pen nib size in steps
+#define TILE_SIZE      64  // plotter paper tile width and height in steps
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE / 8) // one bit per pixel, set => ink
+
+// Functions on the instruction execution path are expanded in line in each engine
+#ifdef __GNUC__
+#define INLINE static inline __attribute__((always_inline))
+#else
+#define INLINE static inline
+#endif
 
 
 /**********************************************************/
@@ -180,18 +318,31 @@ typedef int64_t INT64;
 FILE *diag      = NULL;      // diagnostics output - set to either  stderr or .log
 
 /* File handles for peripherals */
-FILE *ptrFile   = NULL;       // paper tape reader
+unsigned char *ptrData = NULL; // paper tape in reader, NULL => reader not yet used
+size_t ptrLength;             // characters on tape
+size_t ptrPos;                // next character to be read
+INT32  ptrMapped = FALSE;     // TRUE => ptrData mapped from ptrPath
+INT32  keepTape  = FALSE;     // TRUE => leave reader file alone, offset in sidecar
+time_t ptrTime;               // modification time of reader file
+#define OFFSET_SUFFIX ".offset" // sidecar holding offset, length and time of tape
 FILE *punFile   = NULL;       // paper tape punch
 FILE *ttyiFile  = NULL;       // teleprinter input
 FILE *ttyoFile  = NULL;       // teleprinter output
+#define OUTPUT_BUFFER 65536   // default bytes buffered on teletype and punch output
+INT32 outputBuffer = OUTPUT_BUFFER; // set by -buffer, 0 => unbuffered
 
 INT32 verbose   = 0;       // no diagnostics by default
 INT32 diagCount = -1;      // turn diagnostics on at this instruction count
 INT32 abandon   = -1;      // abandon on this instruction count 
 INT32 diagFrom  = -1;      // turn on diagnostics when first reach this address
 INT32 diagLimit = -1;      // stop after this number of instructions executed
-INT32 monLoc    = -1;      // report if this location changes
-INT32 monLast   = -1;
+
+/* Watchpoints and breakpoints, set by -monitor and -break, one bit per store word */
+uint32_t watchBits[STORE_SIZE / 32]; // report writes that change these locations
+uint32_t breakBits[STORE_SIZE / 32]; // stop before executing these locations
+INT32 watching  = FALSE;   // TRUE => some watchBits set
+INT32 breaking  = FALSE;   // TRUE => some breakBits set
+#define BIT_TEST(bits, addr) ((bits)[(addr) >> 5] & (1u << ((addr) & 31)))
 
 /* Input output streams */
 char *ptrPath   = RDR_FILE;    // path for reader input file
@@ -203,10 +354,25 @@ char *storePath = STORE_FILE;  // path for store image
 INT32 lastttych   = -1; // last tty character punched
 INT32 punchCount  = -1; // count of paper tape characters punched
 INT32 ttyCount    = -1; // count of teletype character typed
+INT64 ttyOutCount =  0; // count of teletype characters output
 
 /* Emulated store */
 INT32 store [STORE_SIZE];
 INT32 storeValid = FALSE; // set TRUE when a store image loaded
+INT32 storeBinary = FALSE; // TRUE => store image read or to be written in binary
+#define STORE_PAGE 256      // words per page when checking for changes to the store
+INT32 storeImage[STORE_SIZE]; // store as read in, to detect changes at exit
+INT32 storeImageValid = FALSE; // TRUE => storeImage matches the store file
+
+/* Binary store image: this header followed by the words in host byte order */
+#define STORE_MAGIC   "E900"
+#define STORE_VERSION 1
+typedef struct {
+  char     magic[4];  // STORE_MAGIC
+  INT32    version;   // STORE_VERSION
+  INT32    words;     // number of words following
+  uint32_t checksum;  // storeChecksum() of the words
+} STOREHEADER;
 
 /* Machine state */
 INT32 opKeys = 8181; // setting of keys on operator's control panel, overidden by
@@ -217,21 +383,232 @@ INT32 scReg = SCRLEVEL1;  // address in store of B register
 INT32 lastSCR;       // used to detect dynamic loops
 INT32 level = 1;     // priority level
 INT64 iCount = 0L;   // count of instructions executed
+INT64 emTime = 0L;   // crude estimate of 900 elapsed time in microseconds
 INT32 instruction, f, a, m;
 INT64 fCount[] =     // function code counts
                           {0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L,0L};
 
+/* Pre-decoded instructions, one entry per store word */
+typedef struct {
+  INT32 valid;       // FALSE => entry must be decoded again from store
+  INT32 instruction; // instruction word as decoded
+  INT32 f;           // function code
+  INT32 a;           // absolute address, including module bits
+  INT32 bMod;        // TRUE => B modified
+} DECODED;
+
+DECODED decoded[STORE_SIZE]; // invalidated by every write to the store
+char    cached[STORE_SIZE];  // TRUE => word decoded or part of a cached block
+
 /* Tracing */
 INT32 traceOne      = FALSE; // TRUE => trace current instruction only
+INT32 tracing       = FALSE; // TRUE => tracing enabled
+
+/* Profiling, set by -profile option */
+char  *profilePath  = NULL;  // file for profile report, NULL => not profiling
+INT64  execCount [STORE_SIZE]; // instructions executed at each address
+INT64  readCount [STORE_SIZE]; // operand reads from each address
+INT64  writeCount[STORE_SIZE]; // writes to each address
+INT64 *profileSortBy;        // counts profile report is being sorted by
+
+/* Binary trace, set by -tracefile option, decoded by trace900 */
+#define TRACE_MAGIC   "E9TR"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER  65536  // records buffered between writes
+typedef struct {             // one per instruction traced, after header of magic and version
+  INT64 iCount;
+  INT32 scr, instruction, a; // SCR, instruction word and its address as for printDiagnostics
+  INT32 aReg, qReg, b;       // registers after execution
+} TRACE;
+char  *tracePath  = NULL;    // trace file, NULL => trace as text to diag
+FILE  *traceFile  = NULL;
+TRACE *traceBuffer;
+INT32  traceCount = 0;       // records in traceBuffer
+
+/* Flight recorder of last instructions executed, set by -history option */
+#define HISTORY_FILE ".history" // written on failure or instruction limit
+INT32  historySize = 4096;   // instructions remembered, 0 => none
+uint64_t *history;           // ring of HISTORY() words, 0 => not yet filled
+#define HISTORY(count, instruction, scr) \
+  (((uint64_t) (count) << 33) | ((uint64_t) (instruction) << 14) | (scr))
+INT32  historyMask;          // ring size - 1, ring size a power of two
+
+/* Checkpoints of complete machine state, set by -checkpoint-every and -restore */
+#define CHECKPOINT_FILE    ".checkpoint"
+#define CHECKPOINT_MAGIC   "E9CP"
+#define CHECKPOINT_VERSION 3
+INT32  checkpointEvery = 0;  // instructions between checkpoints, 0 => none
+INT64  nextCheckpoint;       // instruction count at which to take next checkpoint
+char  *restorePath = NULL;   // checkpoint to resume from, NULL => start afresh
+typedef struct {             // followed by the store and, if used, plotter paper
+  char     magic[4];         // CHECKPOINT_MAGIC
+  INT32    version;          // CHECKPOINT_VERSION
+  INT32    aReg, qReg, bReg, scReg, level;
+  INT32    lastttych, punchCount, ttyCount;
+  INT64    iCount, emTime;
+  INT64    fCount[17];
+  INT64    ptrPos, punPos, ttyiPos; // file positions, -1 => device not yet used
+  INT32    paperWidth, paperHeight; // 0 => plotter not yet used
+  INT32    penX, penY, penDown;
+  INT64    ttyOutCount, plotterSteps;
+  INT64    vectorPos;        // offset of -vector file trailer, -1 => file not started
+  INT64    vectorStrokes;
+  INT32    vertexDown;       // pen down at last stroke vertex, -1 => no strokes yet
+  uint32_t checksum;         // storeChecksum() of the store
+} CHECKPOINT;
+
+/* Record mode for looking back in time, set by -record, -whowrote and -rewind */
+#define MAX_WHOWROTE 20      // most recent writes listed by -whowrote
+INT32  recordEvery = 0;      // instructions between snapshots, 0 => not recording
+INT64  nextSnapshot;         // instruction count at which to take next snapshot
+INT64  nextSave = INT64_MAX; // first of nextCheckpoint and nextSnapshot in use
+typedef struct {
+  CHECKPOINT state;          // machine state apart from the store
+  INT32      words[STORE_SIZE];
+} SNAPSHOT;
+SNAPSHOT *snapshots = NULL;  // in order taken
+INT32  snapshotCount = 0, snapshotMax = 0;
+typedef struct {             // one per write to the store
+  INT64 iCount;              // instruction that wrote
+  INT32 scr, addr, old;      // its address, address written and previous contents
+} WRITELOG;
+WRITELOG *writeLog = NULL;
+INT64  logLength = 0, logMax = 0;
+INT32  whoWrote = -1;        // address whose writers are to be listed, -1 => none
+INT32  rewindTo = -1;        // instruction count to go back to, -1 => none
+
+/* Execution engine, set by -engine option */
+#define ENGINE_SWITCH   0    // dispatch on function code via switch
+#define ENGINE_THREADED 1    // direct threaded dispatch via computed goto
+#define ENGINE_BLOCK    2    // cached basic blocks
+#define ENGINE_JIT      3    // cached basic blocks translated to x86-64 code
+INT32 engine        = ENGINE_SWITCH;
+char *engineNames[] = { "switch", "threaded", "block", "jit" };
+
+/* Basic block cache for block engine.  A block is a run of instructions ending
+   with a jump or input/output, translated into a micro-op for each of its words. */
+#define MAX_BLOCK 64         // maximum instructions in a block
+typedef struct {
+  void  *handler;            // runBlocks() handler for function code and B modification
+  INT32  instruction;        // instruction word as translated
+  INT32  a;                  // absolute address, including module bits
+} UOP;
+UOP   uops[STORE_SIZE];        // micro-ops of blocks, indexed by word address
+INT32 blockLength[STORE_SIZE]; // length of block starting at each address, 0 => none
+INT64 blockCount = 0L;         // number of blocks translated
+
+/* Idle loops the block engine runs through without executing each iteration */
+#define LOOP_COUNT 1           // adds then jump if negative back to start of block
+char  blockLoop[STORE_SIZE];   // kind of loop block at address is, 0 => none
+INT64 loopCount = 0L;          // loop iterations fast forwarded
+
+#ifdef JIT
+/* Native code for hot blocks, jit engine only */
+#define JIT_THRESHOLD 16         // block executions before translation
+#define JIT_SIZE      (16 << 20) // bytes of executable memory for translated code
+#define JIT_MARGIN    (256 << 10)// space to leave for translating one block
+#define JIT_DYNSTOP   1          // translated code return codes, 0 => carry on
+#define JIT_BAIL      2          // next instruction must be interpreted
+typedef INT32 (*JITCODE)(void);
+JITCODE jitCode[STORE_SIZE];     // translated code for block at address, NULL => none
+INT32   jitLength[STORE_SIZE];   // instructions translated, a prefix of the block
+INT32   jitHits[STORE_SIZE];     // interpreted executions of block
+unsigned char *jitBuffer = NULL; // executable memory
+unsigned char *jitPtr;           // next free byte of jitBuffer
+INT64   jitCount = 0L;           // number of blocks translated to native code
+#endif
+
+/* Jobs, see runJob() */
+char   *jobPath    = NULL;  // job file, NULL => single run
+INT32   jobStage   = FALSE; // TRUE => running a job stage, tidyExit() returns to job
+INT32   jobExitCode;        // reason job stage ended
+jmp_buf jobEnv;             // where tidyExit() returns to
+char   *punchData;          // punch output of job stage
+size_t  punchLength;
+#define MAX_TAPES 32
+#define MAX_CACHED (MAX_TAPES / 2) // file tapes kept by server, rest left for jobs
+typedef struct {
+  char  *name;              // tape name, NULL => slot unused
+  char  *data;              // characters on tape
+  size_t length;
+  INT32  fromFile;          // TRUE => contents of file name, as of mtime and size
+  time_t mtime;
+  off_t  size;
+  INT64  used;              // tapeClock when last used, for eviction
+} TAPE;
+TAPE    tapes[MAX_TAPES];   // in memory paper tapes for jobs
+INT64   tapeClock = 0;      // count of file tapes looked up
+
+/* Batch runs, see runBatch() */
+char  *batchPath = NULL;    // manifest of runs, NULL => not a batch
+INT32  workers   = 0;       // runs in progress at once, 0 => one per processor
+typedef struct {
+  char  *line;              // directory and arguments
+  pid_t  pid;               // process running it
+  INT32  exitCode;
+  double start, time;       // start and elapsed time in seconds
+} BATCHRUN;
+
+/* Job server, see serve() */
+char  *servePath  = NULL;   // socket to serve jobs on
+char  *clientPath = NULL;   // socket to send job to
+INT32  serving    = FALSE;  // TRUE => running job for client, output not to files
+#define MAX_IMAGES 8
+typedef struct {
+  char  *path;              // file image read from
+  INT32  words[STORE_SIZE];
+} IMAGE;
+IMAGE  images[MAX_IMAGES];  // store images kept for reuse by jobs
+INT32  imageCount = 0;
 
 /* Plotter */
-unsigned char *plotterPaper = NULL;    // != NULL => plotter has been used.
+FILE *plotStream = NULL;               // != NULL => write plot here, not to plotPath
+unsigned char **plotterTiles = NULL;   // != NULL => plotter has been used.
+INT32 plotterTilesAcross, plotterTilesDown; // NULL tile => still blank
   
 INT32 plotterPenX, plotterPenY, plotterPenDown, plotterUsed;
 INT32 plotterPaperWidth  = PAPER_WIDTH;
 INT32 plotterPaperHeight = PAPER_HEIGHT;
 INT32 plotterPenSize     = PEN_SIZE;    
 
+/* Plotter strokes, recorded when -vector given */
+typedef struct {
+  INT32 x, y;          // pen position at end of stroke
+  INT32 down;          // TRUE => pen inks each step from the previous vertex to here
+  INT32 dx, dy;        // direction of each step
+} VERTEX;
+char   *vectorPath  = NULL; // SVG or HPGL output, NULL => ink paper as pen moves
+VERTEX *vertices    = NULL;
+INT32   vertexCount = 0;    // vertices recorded
+INT32   vertexSize  = 0;    // space in vertices
+INT32   vertexDrawn = 0;    // vertices already drawn onto the paper
+FILE   *vectorFile  = NULL; // open once strokes first written
+long    vectorEnd;          // offset of trailer, overwritten by further strokes
+INT64   vectorStrokes = 0;  // strokes written to vectorFile
+
+/* Plotter output written during the run, set by -plot-every */
+INT32   plotEvery    = 0;   // plotter steps between writes, 0 => only at end
+INT64   plotterSteps = 0;   // plotter codes output
+INT64   nextPlot     = -1;  // plotterSteps at which to write next
+
+/* PNG encoding of plotter paper, set by -pnglevel and -pngfilter */
+INT32 pngLevel  = Z_DEFAULT_COMPRESSION; // zlib level 0-9
+INT32 pngFilter = 0;        // PNG filter type used for every row
+char *filterNames[] = { "none", "sub", "up", "average", "paeth" };
+#define BAND_ROWS TILE_SIZE // rows of paper compressed together
+typedef struct {            // horizontal band of paper compressed by one thread
+  INT32  first, last;       // rows in band
+  Bytef *data;              // deflate output, ending on a byte boundary
+  uLong  length;            // bytes in data
+  uLong  adler;             // adler32 of filtered rows
+  uLong  raw;               // bytes of filtered rows
+} BAND;
+typedef struct {            // bands compressed by one thread
+  BAND  *band;
+  INT32  bands, next, step; // thread takes bands next, next+step, ...
+  INT32  failed;            // TRUE => a band could not be compressed
+} BANDWORK;
+
 
 /**********************************************************/
 /*                         FUNCTIONS                      */
@@ -242,24 +619,118 @@ void  decodeArgs(INT32 argc, const char **argv); // decode command line
 void  usage(poptContext optCon, INT32 exitcode, char *error, char *addl);
 void  catchInt();              // interrupt handler
 INT32 addtoi(char* arg);       // read numeric part of argument
+INT32 addresses(char *list, uint32_t *bits); // set bits for list of addresses
+void  watchWrite(INT32 addr, INT32 value); // report write to watched location
+INT32 breakpoint();            // report reaching breakpoint
 void  emulate();               // run emulation
+INT32 runStage(INT32 address); // run from address until the machine stops
+void  resetMachine();          // reset registers and counts, keeping store
+INT32 runJob();                // run stages listed in job file
+INT32 runJobStage(char *address, char *args, INT32 lineNo); // run one job stage
+TAPE *findTape(char *name);    // find in memory tape, NULL if none
+TAPE *sourceTape(char *source, INT32 lineNo); // tape named *name, or file contents
+void  copyTape(char *name, TAPE *source, INT32 reversed); // define tape as copy of another
+void  setTape(char *name, char *data, size_t length); // define in memory tape
+void  evictTape();             // make room for a file tape in the server
+void  writeTapeFile(TAPE *t, char *path); // write in memory tape to file
+void  jobError(INT32 lineNo, char *error, char *addl); // report error in job file
+void  runBatch();              // run batch of independent runs in parallel
+void  startBatchRun(char *line); // start run from batch manifest in child process
+double seconds();              // elapsed time in seconds
+void  loadStoreImage(char *path); // load store image, keeping a copy for reuse
+void  serve();                 // serve jobs on Unix socket
+void  prepareJob(char *path);  // read in store images and tapes for job
+void  serveJob(INT32 conn, char *path); // run job for client in child process
+void  runClient();             // send job to server
+INT32 readLine(INT32 fd, char *line, INT32 size); // read line from socket
+INT32 execute();               // run instructions until machine stops
+INT64 fastLimit();             // instruction count limit for fast execution
+INT32 runSwitch();             // execution engine using switch dispatch
+INT32 runThreaded();           // execution engine using threaded dispatch
+INT32 runSwitchFast(INT64 limit);   // as above without tracing or monitoring
+INT32 runThreadedFast(INT64 limit);
+INT32 runBlocks(INT64 limit);  // fast execution engine using basic blocks
+INT32 translate(INT32 start, void **handlers); // translate basic block, returning its length
+INT32 idleLoop(INT32 start, INT64 limit); // fast forward idle loop, exit code or -1
+void  uncache(INT32 addr);     // discard decoded copies and blocks containing addr
+#ifdef JIT
+void  jitTranslate(INT32 start, INT32 length); // translate block to native code
+INT32 jitUncache(INT32 addr, INT32 start); // uncache() called from native code
+#endif
+INT32 dynamicStop();           // report dynamic stop
+INT32 fastStop();              // dynamic stop in fast loops, -1 if limit reached first
+INLINE void  fetch();          // fetch and decode next instruction
+INLINE INT32 endInstruction(); // end of instruction checks, returns exit code or -1
+INLINE void traceInstruction(); // trace current instruction
+INLINE void remember();        // record instruction in history
+void  writeHistory();          // write out history
+INT32 compareTrace(const void *a, const void *b); // qsort order for history
+void  flushTrace();            // write out buffered trace records
+void  profile();               // count execution, read and write for profiling
+INLINE void  loadB();          // function code handlers
+INLINE void  add();
+INLINE void  negateAdd();
+INLINE void  storeQ();
+INLINE void  loadA();
+INLINE void  storeA();
+INLINE void  collate();
+INLINE void  jumpZero();
+INLINE void  jump();
+INLINE void  jumpNeg();
+INLINE void  increment();
+INLINE void  storeS();
+INLINE void  multiply();
+INLINE void  divide();
+INLINE void  shift();
+void  inputOutput();
 void  checkAddress(INT32 addr);// check address within store bounds
 void  clearStore();            // clear main store
+void  resetCaches();           // discard all decoded instructions and blocks
+INLINE void  storeWrite(INT32 addr, INT32 value); // write to store, invalidating decoded copy
+DECODED *decode(INT32 addr);   // decode instruction at addr into decoded[]
 void  readStore();             // read in a store image
+INT32 readBinaryStore();       // read in a binary store image, FALSE if not binary
+uint32_t storeChecksum(const INT32 *words, INT32 n); // checksum for binary image
 void  tidyExit();              // tidy up and exit
 void  writeStore();            // dump out store image
+INT32 closeSynced(FILE *f);    // flush file to disk and close, nonzero if fails
+void  saveState();             // take checkpoint or snapshot now due
+void  captureState(CHECKPOINT *c); // fill in checkpoint from machine state
+INT32 saveCheckpoint(char *path, CHECKPOINT *c, INT32 *words, unsigned char **tiles);
+void  writeCheckpoint();       // save complete machine state
+void  takeSnapshot();          // save machine state in memory
+void  logWrite(INT32 addr);    // record write to store
+void  reportRecord();          // answer -whowrote and -rewind
+void  readCheckpoint();        // restore complete machine state
 void  printDiagnostics(INT32 i, INT32 f, INT32 a); // print diagnostic information for current instruction
 void  printTime(INT64 us);     // print out time counted in microseconds
 void  printAddr(FILE *f, INT32 addr); // print address in m^nnn format
+void  printInstruction(FILE *f, INT32 word); // print word as an instruction
+void  writeProfile();          // write profile report to profilePath
+INT32 compareCounts(const void *a, const void *b); // qsort order for profile
 
 void  movePlotter(INT32 bits); // Move the plotter pen
 void  setupPlotter(void);      // Clear paper to white pixels
+INLINE void plotPoint(INT32 x, INT32 y); // Ink one pixel on the paper
+void  inkPen(INT32 x, INT32 y); // Ink paper under pen nib at x, y
+void  recordStroke(INT32 down); // Add plotter step to strokes
+void  drawStrokes(void);       // Ink paper with strokes not yet drawn
+void  writeVectors(INT32 last); // Append strokes as SVG or HPGL to vectorPath
+void  writePlot(void);         // Write plotter output so far
 void  savePlotterPaper(void);  // Write paper image to PLOT_FILE
+void  paperRow(INT32 y, Bytef *row); // Row of paper as 1 bit PNG pixels
+void *encodeBands(void *arg);  // Thread filtering and compressing bands
+INT32 encodeBand(BAND *b);     // Filter and compress rows of one band
+void  writeChunk(FILE *fp, char *type, Bytef *data, uLong length); // PNG chunk
+void  openTape();              // map reader input file into memory
+void  closeTape();             // finish with tape in reader
+void  writeTapeOffset();       // record position reached in sidecar
 INT32 readTape();              // read from paper tape
 void  punchTape(INT32 ch);     // punch to paper tape
 INT32 readTTY();               // read from teletype
 void  writeTTY(INT32 ch);      // write to teletype
 void  flushTTY();              // force output of last tty output line
+void  bufferOutput(FILE *f);   // set up buffering for teletype or punch output
 void  loadII();                // load initial orders
 INT32 makeIns(INT32 m, INT32 f, INT32 a); // help for loadII
 
@@ -273,7 +744,14 @@ INT32 main (INT32 argc, const char **argv) {
    signal(SIGINT, catchInt); // allow control-C to end cleanly
    diag = stderr;            // set up diagnostic output for reports
    decodeArgs(argc, argv);   // decode command line and set options etc
-   emulate();                // run emulation
+   if  ( servePath != NULL )
+     serve();                // serve jobs on socket
+   else if ( clientPath != NULL )
+     runClient();            // send job to server
+   else if ( batchPath != NULL )
+     runBatch();             // run batch in parallel
+   else
+     emulate();              // run emulation
 }
 
 void catchInt(INT32 sig, void (*handler)(int)) {
@@ -303,10 +781,54 @@ void decodeArgs (INT32 argc, const char *argv[])
        &ttyInPath, 0, "teletype input", "file"},
       {"plot",    '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
        &plotPath, 0, "plotter output", "file"},
+      {"vector",  '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &vectorPath, 0, "plotter strokes as SVG or HPGL", "file"},
+      {"plot-every", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &plotEvery, 13, "write plotter output every n plotter steps", "integer"},
+      {"pnglevel", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &pngLevel, 11, "plotter PNG compression level (0-9)", "integer"},
+      {"pngfilter", '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &buffer, 12, "plotter PNG filter (none, sub, up, average or paeth)", "name"},
       {"store",   '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
        &storePath, 0, "store image", "file"},
+      {"job",     '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &jobPath, 0, "run stages listed in job file", "file"},
+      {"batch",   '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &batchPath, 0, "run batch of runs listed in manifest file", "file"},
+      {"serve",   '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &servePath, 0, "serve jobs on Unix socket", "socket"},
+      {"client",  '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &clientPath, 0, "send job to server on Unix socket", "socket"},
+      {"workers", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &workers, 0, "batch runs in progress at once", "integer"},
+      {"buffer",  '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &outputBuffer, 0, "bytes buffered on teletype and punch output", "integer"},
+      {"history", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &historySize, 0, "instructions to record for dump on failure", "integer"},
+      {"checkpoint-every", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &checkpointEvery, 0, "save machine state every n instructions", "integer"},
+      {"restore", '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &restorePath, 0, "resume from saved machine state", "file"},
+      {"break", '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &buffer, 9, "stop on reaching locations", "addresses"},
+      {"record", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &recordEvery, 0, "record store writes, snapshot every n instructions", "integer"},
+      {"whowrote", '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &buffer, 8, "list last writes to location when recording", "address"},
+      {"rewind", '\0', POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
+       &rewindTo, 0, "checkpoint from before instruction n when recording", "integer"},
+      {"tracefile", '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &tracePath, 0, "write instruction trace in binary to file", "file"},
+      {"profile", '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &profilePath, 0, "write execution profile to file", "file"},
+      {"engine",  '\0', POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
+       &buffer, 6, "execution engine (switch, threaded, block or jit)", "name"},
       {"dfile",   'd',  POPT_ARG_NONE | POPT_ARGFLAG_ONEDASH,
        0, 1, "diagnostics to file", ""},    
+      {"binary",  '\0', POPT_ARG_NONE | POPT_ARGFLAG_ONEDASH,
+       0, 7, "write store image in binary format", ""},
+      {"keeptape", '\0', POPT_ARG_NONE | POPT_ARGFLAG_ONEDASH,
+       0, 10, "leave reader file unchanged, offset read kept in sidecar", ""},
       {"abandon", 'a',  POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
        &abandon, 0, "abandon after n instructions", "integer"},
       {"height",  'h',  POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
@@ -314,7 +836,7 @@ void decodeArgs (INT32 argc, const char *argv[])
       {"jump",    'j',  POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
        &opKeys, 2, "jump to address", "integer"},
       {"monitor", 'm',  POPT_ARG_STRING | POPT_ARGFLAG_ONEDASH,
-       &buffer, 3, "monitor location", "address"},
+       &buffer, 3, "monitor locations", "addresses"},
       {"Pen", 'p',      POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
        &plotterPenSize, 4, "plotter pen size in steps", "integer"},
       {"rtrace",  'r',  POPT_ARG_INT | POPT_ARGFLAG_ONEDASH,
@@ -354,12 +876,16 @@ void decodeArgs (INT32 argc, const char *argv[])
 	usage(optCon, EXIT_FAILURE, "can only jump to addresses less than 8192", NULL);
       break;
 
-    case 3: // m address (monitor address)
-      monLoc = addtoi(buffer);
-      if ( monLoc == -1 )
-	usage(optCon, EXIT_FAILURE, "malformed address", buffer);
-      if ( monLoc >= STORE_SIZE )
-	usage(optCon, EXIT_FAILURE, "monitor address outside store bounds", buffer);
+    case 3: // m addresses (monitor addresses)
+      if ( !addresses(buffer, watchBits) )
+	usage(optCon, EXIT_FAILURE, "malformed or out of bounds monitor addresses", buffer);
+      watching = TRUE;
+      break;
+
+    case 13: // plotter steps between writes of output
+      if ( plotEvery <= 0 )
+	usage(optCon, EXIT_FAILURE, "plotter output must be written every 1 or more steps", NULL);
+      nextPlot = plotEvery;
       break;
 
     case 4: // p plotter pen size
@@ -374,7 +900,58 @@ void decodeArgs (INT32 argc, const char *argv[])
       if ( diagFrom >= STORE_SIZE )
 	usage(optCon, EXIT_FAILURE, "tracing start address outside store bounds", buffer);
       break;
+
+    case 6: // engine name
+      if ( strcmp(buffer, "switch") == 0 )
+	engine = ENGINE_SWITCH;
+#ifdef __GNUC__
+      else if ( strcmp(buffer, "threaded") == 0 )
+	engine = ENGINE_THREADED;
+      else if ( strcmp(buffer, "block") == 0 )
+	engine = ENGINE_BLOCK;
+#endif
+#ifdef JIT
+      else if ( strcmp(buffer, "jit") == 0 )
+	engine = ENGINE_JIT;
+#endif
+      else
+	usage(optCon, EXIT_FAILURE, "unknown execution engine", buffer);
+      break;
       
+    case 7: // -binary
+      storeBinary = TRUE;
+      break;
+
+    case 9: // break addresses
+      if ( !addresses(buffer, breakBits) )
+	usage(optCon, EXIT_FAILURE, "malformed or out of bounds break addresses", buffer);
+      breaking = TRUE;
+      break;
+
+    case 10: // -keeptape
+      keepTape = TRUE;
+      break;
+
+    case 11: // PNG compression level
+      if ( (pngLevel < 0) || (pngLevel > 9) )
+	usage(optCon, EXIT_FAILURE, "PNG compression level must be 0 to 9", NULL);
+      break;
+
+    case 12: // PNG filter name
+      for ( pngFilter = 0 ; pngFilter < 5 ; pngFilter++ )
+	if  ( strcmp(buffer, filterNames[pngFilter]) == 0 ) break;
+      if  ( pngFilter == 5 )
+	usage(optCon, EXIT_FAILURE, "unknown PNG filter", buffer);
+      break;
+
+    case 8: // whowrote address
+      whoWrote = addtoi(buffer);
+      if ( whoWrote == -1 )
+	usage(optCon, EXIT_FAILURE, "malformed address", buffer);
+      if ( whoWrote >= STORE_SIZE )
+	usage(optCon, EXIT_FAILURE, "whowrote address outside store bounds", buffer);
+      break;
+
     default:
       fprintf(stderr, "internal error in decodeArgs (%d)\n", c);
       exit(EXIT_FAILURE);
@@ -392,6 +969,16 @@ void decodeArgs (INT32 argc, const char *argv[])
   if ( (buffer = (char *) poptGetArg(optCon)) != NULL ) // check for extra arguments
        usage(optCon, EXIT_FAILURE, "unexpected argument", buffer);
 
+  if  ( ((restorePath != NULL) || (recordEvery > 0)) &&
+	((jobPath != NULL) || (batchPath != NULL) || (servePath != NULL) || (clientPath != NULL)) )
+    usage(optCon, EXIT_FAILURE, "-restore and -record only apply to a single run", NULL);
+  if  ( ((whoWrote >= 0) || (rewindTo >= 0)) && (recordEvery <= 0) )
+    usage(optCon, EXIT_FAILURE, "-whowrote and -rewind need -record", NULL);
+#ifdef JIT
+  if  ( (recordEvery > 0) && (engine == ENGINE_JIT) )
+    engine = ENGINE_BLOCK; // native code writes to store without logging
+#endif
+
   poptFreeContext(optCon); // release context
        
   // tidy up and report options
@@ -404,6 +991,32 @@ void decodeArgs (INT32 argc, const char *argv[])
     {
       diagCount = diagFrom = -1; // -r overides -s, -t
     }
+  if  ( history == NULL )
+    { // ring rounded up to a power of two so wrap round is a mask
+      INT32 size = 1;
+      while ( size < historySize ) size <<= 1;
+      if  ( (history = calloc(size, sizeof(uint64_t))) == NULL )
+	{
+	  fprintf(stderr, "Cannot allocate history of %d instructions\n", historySize);
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+      historyMask = size - 1;
+    }
+  if  ( (tracePath != NULL) && (traceFile == NULL) )
+    {
+      if  ( ((traceFile = fopen(tracePath, "wb")) == NULL) ||
+	    ((traceBuffer = malloc(TRACE_BUFFER * sizeof(TRACE))) == NULL) )
+	{
+	  fprintf(stderr, "Cannot open trace file ");
+	  perror(tracePath);
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+      const INT32 version = TRACE_VERSION;
+      fwrite(TRACE_MAGIC, 1, 4, traceFile);
+      fwrite(&version, sizeof(version), 1, traceFile);
+    }
   if  ( verbose & 1 )
      {
 	if ( diag != stderr )
@@ -412,9 +1025,26 @@ void decodeArgs (INT32 argc, const char *argv[])
         fprintf(diag, "Paper tape will be punched to %s\n", punPath);
         fprintf(diag, "Teletype input will be read from %s\n", ttyInPath);
         fprintf(diag, "Plotter output will go to %s\n", plotPath);
+	if ( vectorPath != NULL )
+	  fprintf(diag, "Plotter strokes will be written to %s\n", vectorPath);
+	if ( plotEvery > 0 )
+	  fprintf(diag, "Plotter output will be written every %d steps\n", plotEvery);
 	fprintf(diag, "Plotter paper width %d, height %d\n", plotterPaperWidth, plotterPaperHeight);
 	fprintf(diag, "Plotter pen size %d steps\n", plotterPenSize);
         fprintf(diag, "Store image will be read from %s\n", storePath);
+	fprintf(diag, "Execution engine is %s\n", engineNames[engine]);
+	if ( jobPath != NULL )
+	  fprintf(diag, "Job will be read from %s\n", jobPath);
+	if ( profilePath != NULL )
+	  fprintf(diag, "Profile will be written to %s\n", profilePath);
+	if ( tracePath != NULL )
+	  fprintf(diag, "Instruction trace will be written to %s\n", tracePath);
+	if ( checkpointEvery > 0 )
+	  fprintf(diag, "Machine state will be saved in %s every %d instructions\n",
+		  CHECKPOINT_FILE, checkpointEvery);
+	if ( recordEvery > 0 )
+	  fprintf(diag, "Recording store writes and snapshots every %d instructions\n",
+		  recordEvery);
 	fprintf(diag, "Execution will commence at address ");
 	printAddr(diag, opKeys);
 	fprintf(diag," (%d)\n", opKeys);
@@ -428,12 +1058,10 @@ void decodeArgs (INT32 argc, const char *argv[])
 	if ( diagLimit >= 0 )
 	  fprintf(diag, "Limited tracing will start after %d instructions executed\n",
 		  diagLimit);
-	if ( monLoc >= 0 )
-	  {
-	    fprintf(diag, "Location ");
-	    printAddr(diag, monLoc);
-	    fprintf(diag, " (%d) will be monitored\n", monLoc);
-	  }
+	if ( watching )
+	  fprintf(diag, "Locations will be monitored\n");
+	if ( breaking )
+	  fprintf(diag, "Execution will stop at breakpoints\n");
        }
 }
 
@@ -445,22 +1073,44 @@ void usage (poptContext optCon, INT32 exitcode, char *error, char *addl)
 }
 
 INT32 addtoi (char *s) {
-  INT32 value = 0;
-  INT32 i;
+  INT32 value  = 0;
+  INT32 module = -1; // module number if m^a form
+  if  ( *s == '\0' ) return -1;
   while  ( *s != '\0' )
     {
       INT32 ch = *s++;
       if  ( isdigit(ch) )
         value = value * 10 + ch - (int)'0'; 
-      else if ( ch == '^' )
+      else if ( (ch == '^') && (module == -1) && (*s != '\0') )
         {
-	  if ( (i = atoi(s)) == 0 )
-	    return -1; // atoi failed
-          return value * 8192 + i;
+	  module = value;
+	  value  = 0;
 	}
       else return -1;
     } // while
-  return value;
+  if  ( module == -1 ) return value;
+  return ( value < 8192 ) ? module * 8192 + value : -1;
+}
+
+INT32 addresses (char *list, uint32_t *bits) { // a[-b],... returns FALSE if malformed
+  char *copy = strdup(list), *item, *rest;
+  INT32 ok   = TRUE;
+  for ( item = strtok_r(copy, ",", &rest) ; item != NULL ; item = strtok_r(NULL, ",", &rest) )
+    {
+      char *to = strchr(item, '-');
+      if  ( to != NULL ) *to++ = '\0';
+      const INT32 first = addtoi(item);
+      const INT32 last  = ( to != NULL ) ? addtoi(to) : first;
+      if  ( (first < 0) || (last < first) || (last >= STORE_SIZE) )
+	{
+	  ok = FALSE;
+	  break;
+	}
+      for ( INT32 addr = first ; addr <= last ; addr++ )
+	bits[addr >> 5] |= 1u << (addr & 31);
+    }
+  free(copy);
+  return ok;
 }
 
 
@@ -471,444 +1121,2615 @@ INT32 addtoi (char *s) {
 
 void emulate () {
 
-  INT32 exitCode = EXIT_SUCCESS; // reason for terminating
-  INT32 tracing  = FALSE; // true if tracing enabled
-  INT64 emTime   = 0L; // crude estimate of 900 elapsed time
-
-  FILE *stop; // used to open stopFile
+  INT32 exitCode; // reason for terminating
 
   // set up machine ready to execute
   clearStore();  // start with a cleared store
   readStore();   // read in store image if available
-  loadII();      // load initial orders
   ttyoFile = stdout; // teletype output to stdout
-  store[scReg] = opKeys; // set SCR from operator control panel keys
+  bufferOutput(ttyoFile);
+
+  exitCode = ( jobPath != NULL ) ? runJob() : runStage(opKeys);
+
+  tidyExit(exitCode);
+}
+
+INT32 runStage (INT32 address) {
+
+  INT32 exitCode; // reason for terminating
+  double hostTime; // host seconds spent executing
+
+  if  ( restorePath != NULL )
+    readCheckpoint(); // carry on from where checkpoint was taken
+  else
+    {
+      loadII();      // load initial orders
+      store[scReg] = address; // set SCR from operator control panel keys
+    }
+  nextCheckpoint = iCount + checkpointEvery;
+  nextSnapshot   = iCount; // snapshot of starting state
+  saveState();
   
   if   ( verbose & 1 )
     {
       fprintf(diag,"Starting execution from location ");
-      printAddr(diag, opKeys);
+      printAddr(diag, store[scReg]);
       fputc('\n', diag);
     }
-  if   ( monLoc >= 0 ) monLast = store[monLoc]; // set up monitoring
+  // run instructions until the machine stops
+  hostTime = seconds();
+  exitCode = execute();
+  hostTime = seconds() - hostTime;
 
-  // instruction fetch and decode loop
-  while ( ++iCount )
+  // execution complete
+  if   ( verbose & 1 ) // print statistics
     {
-      
-      // increment SCR
-      lastSCR = store[scReg];
-      store[scReg]++;
-      checkAddress(lastSCR);
-
-      // fetch and decode instruction;
-      instruction = store[lastSCR];
-      f = (instruction >> FN_SHIFT) & FN_MASK;
-      a = (instruction & ADDR_MASK) | (lastSCR & MOD_MASK);
-      fCount[f]+=1; // track number of executions of each function code
-
-      // perform B modification if needed
-      if ( instruction >= BIT18 )
-        {
-  	  m = (a + store[bReg]) & MASK16;
-	  emTime += 6;
+      fprintf(diag, "exit code %d\n", exitCode);
+      fprintf(diag, "Function code count\n");
+      for ( INT32 i = 0 ; i <= 15 ; i++ )
+	{
+	  fprintf(diag, "%4d: %8lld (%3lld%%)",
+		  i, (long long) fCount[i], (long long) ((fCount[i] * 100L) / iCount));
+	  if  ( ( i % 4) == 3 ) fputc('\n', diag);
 	}
-      else
-	  m = a & MASK16;
-
-      // perform function determined by function code f
-      switch ( f )
-        {
-
-        case 0: // Load B
-	    checkAddress(m);
-	    qReg = store[m]; store[bReg] = qReg;
-	    emTime += 30;
-	    break;
-
-          case 1: // Add
-       	    aReg = (aReg + store[m]) & MASK18;
-	    emTime += 23;
-	    break;
+       if  ( engine >= ENGINE_BLOCK )
+	 fprintf(diag, "%lld basic blocks translated, %lld idle loop iterations skipped\n",
+		 (long long) blockCount, (long long) loopCount);
+#ifdef JIT
+       if  ( engine == ENGINE_JIT )
+	 fprintf(diag, "%lld blocks translated to native code\n", (long long) jitCount);
+#endif
+       fprintf(diag, "%lld instructions executed in ", (long long) iCount);
+       printTime(emTime);
+       fprintf(diag, " of simulated time\n");
+       fprintf(diag, "%lld teletype and %d punch characters output, %.0f per second\n",
+	       (long long) ttyOutCount, punchCount + 1,
+	       (hostTime > 0) ? (ttyOutCount + punchCount + 1) / hostTime : 0.0);
+     }
 
-          case 2: // Negate and add
-	    checkAddress(m);
-	    aReg = (store[m] - aReg) & MASK18;
-	    emTime += 26;
-	    break;
+  return exitCode;
+}
 
-          case 3: // Store Q
-	    checkAddress(m);
-	    store[m] = qReg >> 1;
-	    emTime += 25;
-	    break;
+void resetMachine () {
+  aReg      = qReg = 0;
+  bReg      = BREGLEVEL1;
+  scReg     = SCRLEVEL1;
+  level     = 1;
+  iCount    = 0L;
+  emTime    = 0L;
+  memset(fCount, 0, sizeof(fCount));
+  lastttych = punchCount = ttyCount = -1;
+  ttyOutCount = 0;
+  traceOne  = tracing = FALSE;
+  memset(history, 0, (historyMask + 1) * sizeof(uint64_t));
+  resetCaches(); // initial instructions are written directly to store
+}
 
-          case 4: // Load A
-	    checkAddress(m);
-	    aReg = store[m];
-	    emTime += 23;
-	    break;
+/* Production runs use a fast loop with none of the tracing and monitoring checks,
+   running up to an instruction limit derived from -abandon, -trace and -rtrace.
+   Once a trace or monitor trigger is armed execution is handed to the fully
+   instrumented loop for the rest of the run. */
 
-          case 5: // Store A
-	    if   ( level == 1 && m >= 8180 && m <= 8191 )
-	      {
-		if ( verbose & 1 )
-	            fprintf(diag,
-		      "Write to initial instructions ignored in priority level 1");
-	      }
-	    else
-	      {
-		checkAddress(m);
-	        store[m] = aReg;
-	      }
-	    emTime += 25;
-	    break;
+INT32 execute () {
+  INT32 exitCode;
+  INT64 limit;
+  while ( (limit = fastLimit()) >= 0 )
+    {
+      switch ( engine )
+	{
+	  case ENGINE_THREADED: exitCode = runThreadedFast(limit); break;
+	  case ENGINE_BLOCK:
+	  case ENGINE_JIT:      exitCode = runBlocks(limit);       break;
+	  default:              exitCode = runSwitchFast(limit);
+	}
+      if  ( exitCode >= 0 ) return exitCode;
+      if  ( iCount >= nextSave ) saveState();
+      if  ( (abandon != -1) && (iCount >= abandon) )
+	{
+	  flushTTY();
+	  if  ( verbose & 1 ) fprintf(diag, "Instruction limit reached\n");
+	  return EXIT_LIMITSTOP;
+	}
+    }
+  return ( engine == ENGINE_THREADED ) ? runThreaded() : runSwitch();
+}
 
-          case 6: // Collate
-	    checkAddress(m);
-	    aReg &= store[m];
-	    emTime += 23;
-	    break;
+INT64 fastLimit () { // instruction count fast loop may run to, -1 if must trace
+  INT64 limit = INT64_MAX;
+  if  ( watching || breaking || (diagFrom >= 0) || (verbose & 8) || tracing || traceOne ||
+	(profilePath != NULL) )
+    return -1; // triggers that can only be checked instruction by instruction
+  if  ( diagCount >= 0 )
+    {
+      if  ( iCount + 1 >= diagCount ) return -1;
+      limit = diagCount - 1;
+    }
+  if  ( (diagLimit >= 0) && (iCount < diagLimit) )
+    {
+      if  ( iCount + 1 == diagLimit ) return -1;
+      if  ( diagLimit - 1 < limit ) limit = diagLimit - 1;
+    }
+  if  ( nextSave < limit ) limit = nextSave;
+  if  ( (abandon >= 0) && (abandon < limit) )
+    limit = ( abandon > iCount ) ? abandon : iCount + 1; // always make progress
+  return limit;
+}
 
-          case 7: // Jump if zero
-  	    if   ( aReg == 0 )
-	      {
-	        traceOne = tracing && (verbose & 2);
-	        store[scReg] = m;
-		emTime += 28;
-	      }
-	    if  ( aReg > 0 )
-	      emTime += 21;
-	    else
-	      emTime += 20;
-	    break;
+/* Execution engines - each runs instructions until the machine stops and returns
+   the exit code.  They share fetch(), the function code handlers and
+   endInstruction() and differ only in how they dispatch on the function code.
+   The fast variants return -1 on reaching the instruction count limit and only
+   check for a dynamic stop after functions that can alter the SCR. */
 
-          case 8: // Jump unconditional
-	    store[scReg] = m;
-	    emTime += 23;
-	    break;
+INT32 runSwitch () {
+  INT32 exitCode;
+  while ( TRUE )
+    {
+      fetch();
+      switch ( f ) // perform function determined by function code f
+	{
+	  case  0: loadB();      break;
+	  case  1: add();        break;
+	  case  2: negateAdd();  break;
+	  case  3: storeQ();     break;
+	  case  4: loadA();      break;
+	  case  5: storeA();     break;
+	  case  6: collate();    break;
+	  case  7: jumpZero();   break;
+	  case  8: jump();       break;
+	  case  9: jumpNeg();    break;
+	  case 10: increment();  break;
+	  case 11: storeS();     break;
+	  case 12: multiply();   break;
+	  case 13: divide();     break;
+	  case 14: shift();      break;
+	  case 15: inputOutput();
+	}
+      if  ( (exitCode = endInstruction()) >= 0 ) return exitCode;
+    }
+}
 
-          case 9: // Jump if negative
-	    if   ( aReg >= BIT18 )
-	      {
-	        traceOne = tracing && (verbose & 2);
-		store[scReg] = m;
-		emTime += 25;
-	      }
-	    emTime += 20;
-	    break;
+INT32 runSwitchFast (INT64 limit) {
+  while ( iCount < limit )
+    {
+      fetch();
+      switch ( f )
+	{
+	  // functions that cannot alter the SCR
+	  case  1: add();        continue;
+	  case  2: negateAdd();  continue;
+	  case  4: loadA();      continue;
+	  case  6: collate();    continue;
+	  case 12: multiply();   continue;
+	  case 13: divide();     continue;
+	  case 14: shift();      continue;
+
+	  // functions that can, by jumping or writing to store
+	  case  0: loadB();      break;
+	  case  3: storeQ();     break;
+	  case  5: storeA();     break;
+	  case  7: jumpZero();   break;
+	  case  8: jump();       break;
+	  case  9: jumpNeg();    break;
+	  case 10: increment();  break;
+	  case 11: storeS();     break;
+	  case 15: inputOutput();
+	}
+      if  ( store[scReg] == lastSCR ) return fastStop();
+    }
+  return -1;
+}
 
-          case 10: // increment in store
-	    checkAddress(m);
- 	    store[m] = (store[m] + 1) & MASK18;
-	    emTime += 24;
-	    break;
+#ifdef __GNUC__
+// Direct threaded dispatch using GCC labels as values.  Each handler ends with
+// its own indirect jump to the next handler so the host branch predictor sees
+// sixteen dispatch sites rather than one.
+#define NEXT if  ( (exitCode = endInstruction()) >= 0 ) return exitCode; \
+             fetch(); goto *handlers[f]
+
+INT32 runThreaded () {
+  static void *handlers[] = { &&fn0, &&fn1, &&fn2,  &&fn3,  &&fn4,  &&fn5,  &&fn6,  &&fn7,
+			      &&fn8, &&fn9, &&fn10, &&fn11, &&fn12, &&fn13, &&fn14, &&fn15 };
+  INT32 exitCode;
+  fetch();
+  goto *handlers[f];
+  fn0:  loadB();       NEXT;
+  fn1:  add();         NEXT;
+  fn2:  negateAdd();   NEXT;
+  fn3:  storeQ();      NEXT;
+  fn4:  loadA();       NEXT;
+  fn5:  storeA();      NEXT;
+  fn6:  collate();     NEXT;
+  fn7:  jumpZero();    NEXT;
+  fn8:  jump();        NEXT;
+  fn9:  jumpNeg();     NEXT;
+  fn10: increment();   NEXT;
+  fn11: storeS();      NEXT;
+  fn12: multiply();    NEXT;
+  fn13: divide();      NEXT;
+  fn14: shift();       NEXT;
+  fn15: inputOutput(); NEXT;
+}
 
-          case 11:  // Store S
-	    {
-	      qReg = store[scReg] & MOD_MASK;
-	      store[m] = store[scReg] & ADDR_MASK;
-	      emTime += 30;
-	      break;
-	    }
+#undef NEXT
+
+#define NEXT     if  ( iCount >= limit ) return -1; \
+                 fetch(); goto *handlers[f]
+#define NEXTSTOP if  ( store[scReg] == lastSCR ) return fastStop(); \
+                 NEXT
+
+INT32 runThreadedFast (INT64 limit) {
+  static void *handlers[] = { &&fn0, &&fn1, &&fn2,  &&fn3,  &&fn4,  &&fn5,  &&fn6,  &&fn7,
+			      &&fn8, &&fn9, &&fn10, &&fn11, &&fn12, &&fn13, &&fn14, &&fn15 };
+  if  ( iCount >= limit ) return -1;
+  fetch();
+  goto *handlers[f];
+  fn0:  loadB();       NEXTSTOP;
+  fn1:  add();         NEXT;
+  fn2:  negateAdd();   NEXT;
+  fn3:  storeQ();      NEXTSTOP;
+  fn4:  loadA();       NEXT;
+  fn5:  storeA();      NEXTSTOP;
+  fn6:  collate();     NEXT;
+  fn7:  jumpZero();    NEXTSTOP;
+  fn8:  jump();        NEXTSTOP;
+  fn9:  jumpNeg();     NEXTSTOP;
+  fn10: increment();   NEXTSTOP;
+  fn11: storeS();      NEXTSTOP;
+  fn12: multiply();    NEXT;
+  fn13: divide();      NEXT;
+  fn14: shift();       NEXT;
+  fn15: inputOutput(); NEXTSTOP;
+}
 
-          case 12:  // Multiply
-	    {
-	      checkAddress(m);
-	      {
-	        // extend sign bits for a and store[m]
-	        const INT64 al = (INT64) ( ( aReg >= BIT18 ) ? aReg - BIT19 : aReg );
-	        const INT64 sl = (INT64) ( ( store[m] >= BIT18 ) ? store[m] - BIT19 : store[m] );
-	        INT64  prod = al * sl;
-	        qReg = (INT32) ((prod << 1) & MASK18 );
-	        if   ( al < 0 ) qReg |= 1;
-	        prod = prod >> 17; // arithmetic shift
- 	        aReg = (int) (prod & MASK18);
-	        emTime += 79;
-	        break;
-	      }
-	    }
+#undef NEXT
+#undef NEXTSTOP
+#else
+INT32 runThreaded () {
+  return runSwitch(); // labels as values not available, -engine rejects threaded
+}
 
-          case 13:  // Divide
+INT32 runThreadedFast (INT64 limit) {
+  return runSwitchFast(limit);
+}
+#endif
+
+#ifdef __GNUC__
+// Each micro-op holds the address of its handler below, one per function code
+// with and without B modification, so a block runs from handler to handler
+// without decoding or dispatching on the function code.  Every instruction still
+// updates the SCR, counts and history exactly as fetch() does.  At the end of a
+// block its successor is looked up by the new SCR and entered directly.
+#define OP(n, handler, next) \
+  mod##n: m = (op->a + store[bReg]) & MASK16; emTime += 6; goto do##n; \
+  fn##n:  m = op->a & MASK16; \
+  do##n:  ++iCount; lastSCR = op - uops; store[scReg] = lastSCR + 1; \
+          instruction = op->instruction; f = n; a = op->a; \
+          fCount[n]+=1; remember(); handler(); next
+#define NEXT     if  ( ++op < end ) goto *op->handler; \
+                 goto chain
+#define NEXTSTOP if  ( store[scReg] != lastSCR + 1 ) /* jumped or SCR written */ \
+                   { \
+		     if  ( store[scReg] == lastSCR ) return fastStop(); \
+		     goto chain; \
+		   } \
+                 if  ( blockLength[start] == 0 ) goto chain; /* block overwritten */ \
+                 NEXT
+
+INT32 runBlocks (INT64 limit) {
+  static void *handlers[] = { &&fn0,  &&fn1,  &&fn2,  &&fn3,  &&fn4,  &&fn5,  &&fn6,  &&fn7,
+			      &&fn8,  &&fn9,  &&fn10, &&fn11, &&fn12, &&fn13, &&fn14, &&fn15,
+			      &&mod0, &&mod1, &&mod2, &&mod3, &&mod4, &&mod5, &&mod6, &&mod7,
+			      &&mod8, &&mod9, &&mod10,&&mod11,&&mod12,&&mod13,&&mod14,&&mod15 };
+  INT32 exitCode, start, length;
+  const UOP *op, *end;
+
+ dispatch:
+  while ( iCount < limit )
+    {
+      start = store[scReg];
+      checkAddress(start);
+      if  ( blockLoop[start] )
+	{
+	  if  ( (exitCode = idleLoop(start, limit)) >= 0 ) return exitCode;
+	  if  ( iCount >= limit ) continue;
+	}
+#ifdef JIT
+      if  ( (jitCode[start] != NULL) && (iCount + jitLength[start] <= limit) )
+	{ // run native code, then any instruction it could not translate
+	  switch ( jitCode[start]() )
 	    {
-	      checkAddress(m);
-	      {
-	        // extend sign bit for aq
-	        const INT64 al   = (INT64) ( ( aReg >= BIT18 ) ? aReg - BIT19 : aReg ); // sign extend
-	        const INT64 ql   = (INT64) qReg;
-	        const INT64 aql  = (al << 18) | ql;
-	        const INT64 ml   = (INT64) ( ( store[m] >= BIT18 ) ? store[m] - BIT19 : store[m] );
-                const INT64 quot = (( aql / ml) >> 1) & MASK18;
-	        const INT32 q     = (INT32) quot;
-  	        aReg = q | 1;
-	        qReg = q & 0777776;
-	        emTime += 79;
-	        break;
-	      }
+	      case JIT_DYNSTOP:
+		return fastStop();
+	      case JIT_BAIL:
+		if  ( (exitCode = runSwitchFast(iCount + 1)) >= 0 ) return exitCode;
 	    }
+	  continue;
+	}
+#endif
+      length = blockLength[start] ? blockLength[start] : translate(start, handlers);
 
-          case 14:  // Shift - assumes >> applied to a signed long or int is arithmetic
-	    {
-              INT32       places = m & ADDR_MASK;
-	      const INT64 al  = (INT64) ( ( aReg >= BIT18 ) ? aReg - BIT19 : aReg ); // sign extend
-	      const INT64 ql  = qReg;
-	      INT64       aql = (al << 18) | ql;
-	      
-	      if   ( places <= 2047 )
-	        {
-		  emTime += (24 + 7 * places);
-	          if   ( places >= 36 ) places = 36;
-	          aql <<= places;
-	        }
-	      else if ( places >= 6144 )
-	        { // right shift is arithmetic
-	          places = 8192 - places;
-		  emTime += (24 + 7 * places);
-	          if ( places >= 36 ) places = 36;
-		  aql >>= places;
-	        }  
-	      else
-	        {
-		  flushTTY();
-	          fprintf(diag, "*** Unsupported i/o 14 i/o instruction\n");
-	          printDiagnostics(instruction, f, a);
-	          tidyExit(EXIT_FAILURE);
-	          /* NOT REACHED */
-	        }
-
-	      qReg = (int) (aql & MASK18);
-	      aReg = (int) ((aql >> 18) & MASK18);
-	      break;
-	    }
+      if  ( (length == 0) || (iCount + length > limit) )
+	{ // execute a single instruction the ordinary way
+	  if  ( (exitCode = runSwitchFast(iCount + 1)) >= 0 ) return exitCode;
+	  continue;
+	}
+#ifdef JIT
+      if  ( (engine == ENGINE_JIT) && (++jitHits[start] == JIT_THRESHOLD) )
+	jitTranslate(start, length);
+#endif
+      op  = &uops[start];
+      end = op + length;
+      goto *op->handler;
+    }
+  return -1;
+
+  // functions that cannot alter the SCR or the store
+  OP( 1, add,         NEXT);
+  OP( 2, negateAdd,   NEXT);
+  OP( 4, loadA,       NEXT);
+  OP( 6, collate,     NEXT);
+  OP(12, multiply,    NEXT);
+  OP(13, divide,      NEXT);
+  OP(14, shift,       NEXT);
+
+  // functions that can
+  OP( 0, loadB,       NEXTSTOP);
+  OP( 3, storeQ,      NEXTSTOP);
+  OP( 5, storeA,      NEXTSTOP);
+  OP( 7, jumpZero,    NEXTSTOP);
+  OP( 8, jump,        NEXTSTOP);
+  OP( 9, jumpNeg,     NEXTSTOP);
+  OP(10, increment,   NEXTSTOP);
+  OP(11, storeS,      NEXTSTOP);
+  OP(15, inputOutput, NEXTSTOP);
+
+ chain: // go straight on to the successor block unless the dispatch loop is needed
+  start = store[scReg];
+  if  ( (start < STORE_SIZE) && ((length = blockLength[start]) != 0) && !blockLoop[start] &&
+	(iCount + length <= limit) && (engine == ENGINE_BLOCK) )
+    {
+      op  = &uops[start];
+      end = op + length;
+      goto *op->handler;
+    }
+  goto dispatch;
+}
 
-            case 15:  // Input/output etc
-	      {
-                const INT32 z = m & ADDR_MASK;
-	        switch   ( z )
-	    	  {
-
-		    case 2048: // read from tape reader
-		      { 
-	                const INT32 ch = readTape(); 
-	                aReg = ((aReg << 7) | ch) & MASK18;
-			emTime += 4000; // assume 250 ch/s reader
-	                break;
-	               }
-
-	            case 2052: // read from teletype
-		      {
-	                const INT32 ch = readTTY();
-	                aReg = ((aReg << 7) | ch) & MASK18;
-			emTime += 100000; // assume 10 ch/s teletype
-	                break;
-	              }
-
-		  case 4864: // send to plotter
-		    
-		      movePlotter(aReg);
-		      if   (aReg >= 16 )
-		      {
-			  emTime += 20000;  // 20ms per step
-		      }
-		      else
-		      {
-			  emTime += 3300;   // 3.3ms
-		      }		  
-		      break;
-
-	            case 6144: // write to paper tape punch 
-	              punchTape(aReg & 255);
-		      emTime += 9091; // assume 110 ch/s punch
-	              break;
-
-	            case 6148: // write to teletype
-	              writeTTY(aReg & 255);
-		      emTime += 100000; // assume 10 ch/s teletype
-	              break;	      
-	  
-	            case 7168:  // Level terminate
-	              level = 4;
-	              scReg = SCRLEVEL4;
-		      bReg  = BREGLEVEL4;
-		      emTime += 19;
-	              break;
-
-	            default:
-		      flushTTY();
-	              fprintf(diag, "*** Unsupported 15 i/o instruction\n");
-	              printDiagnostics(instruction, f, a);
-	              tidyExit(EXIT_FAILURE);
-	              /* NOT REACHED */
-		  } // end 15 switch
-	      } // end case 15
-	} // end function switch
-
-        // check for change on monLoc
-        if   ( monLoc >= 0 && store[monLoc] != monLast )
-	  {
-	    fprintf(diag, "Monitored location changed from %d to %d\n",
-		monLast, store[monLoc]);
-	    monLast = store[monLoc];
-	    traceOne = TRUE;
-          }
+#undef OP
+#undef NEXT
+#undef NEXTSTOP
+#else
+INT32 runBlocks (INT64 limit) {
+  return runSwitchFast(limit); // labels as values not available, -engine rejects block
+}
+#endif
 
-        // check to see if need to start diagnostic tracing
-        if   ( (lastSCR == diagFrom) || ( (diagCount != -1) && (iCount >= diagCount)) )
-	    tracing = TRUE;
-        if   ( iCount == diagLimit )
-	  {
-	    tracing = TRUE;
-	    abandon = iCount + 1000; // trace 1000 instructions
-	  }
+INT32 translate (INT32 start, void **handlers) {
+  INT32 length = 0;
+  for ( INT32 addr = start ; (addr < STORE_SIZE) && (length < MAX_BLOCK) ; addr++ )
+    {
+      if  ( (addr == SCRLEVEL1) || (addr == SCRLEVEL4) ) break; // never cached
+      const DECODED *d = decode(addr);
+      uops[addr].handler     = handlers[d->bMod ? d->f + 16 : d->f];
+      uops[addr].instruction = d->instruction;
+      uops[addr].a           = d->a;
+      length++;
+      if  ( (d->f == 7) || (d->f == 8) || (d->f == 9) || (d->f == 15) ) break; // end of block
+    }
+  blockLength[start] = length;
+  if  ( length > 0 ) blockCount++;
+
+  // look for loops idleLoop() can deal with
+  blockLoop[start] = 0;
+  if  ( length == 0 ) return 0;
+  const DECODED *last = &decoded[start + length - 1];
+  if  ( !last->bMod && (last->f == 9) && ((last->a & MASK16) == start) )
+    {
+      blockLoop[start] = LOOP_COUNT;
+      for ( INT32 i = 0 ; i < length - 1 ; i++ )
+	if  ( decoded[start + i].f != 1 ) blockLoop[start] = 0;
+    }
+  return length;
+}
 
-        // print diagnostics if required
-        if   ( traceOne )
-	  {
- 	    flushTTY();
-	    traceOne = FALSE; // dealt with single case
-  	    printDiagnostics(instruction, f, a);
-          }
-	else if ( tracing && (verbose & 4) )
-	  {
-	    flushTTY();
-	    printDiagnostics(instruction, f, a);
-	  }
-	  
-	// check for limits
-        if   ( (abandon != -1) && (iCount >= abandon) )
-        {
-	  flushTTY();
-          if  ( verbose & 1 ) fprintf(diag, "Instruction limit reached\n");
-          exitCode = EXIT_LIMITSTOP;
-  	  break;
-        }
+/* Idle loops are fast forwarded, leaving the machine exactly as if every iteration
+   had been executed, instruction count, time and function counts included.
 
-        // check for dynamic stop
-        if   ( store[scReg] == lastSCR ) 
-	  {
-	    flushTTY();
-	    if   ( verbose & 1 )
-	      {
-	        fprintf(diag, "Dynamic stop at ");
-	        printAddr(diag, lastSCR);
-	         fputc('\n', diag);
-	       }
-	    if ( (stop = fopen(STOP_FILE, "w")) == NULL )
-	      {
-		fprintf(stderr, ERR_FOPEN_STOP_FILE);
-		perror(STOP_FILE);
-		exit(EXIT_FAILURE);
-		/* NOT REACHED */
-	      }
+   A counting loop is a block of adds of constants ending with a jump if negative
+   back to its start.  It writes nothing so while A is negative each iteration adds
+   the same amount to A, and the number of iterations is worked out directly.  All
+   but the last are skipped, or fewer if the instruction limit comes first. */
 
-	    fprintf(stop, "%d", lastSCR);
-	    fclose(stop);
-	    exitCode = EXIT_DYNSTOP;
-	    break;
-	  }
-    } // end while fetching and decoding instructions
+INT32 idleLoop (INT32 start, INT64 limit) {
+  const INT32 length = blockLength[start];
+  if  ( length == 0 ) return -1; // block since overwritten
 
-  // execution complete
-  if   ( verbose & 1 ) // print statistics
+  // find amount added per iteration and time taken
+  if  ( aReg < BIT18 ) return -1; // A not negative so loop is left first time
+  INT64 add = 0, time = 45; // jump if negative taken
+  for ( INT32 i = 0 ; i < length - 1 ; i++ )
     {
-      fprintf(diag, "exit code %d\n", exitCode);
-      fprintf(diag, "Function code count\n");
-      for ( INT32 i = 0 ; i <= 15 ; i++ )
-	{
-	  fprintf(diag, "%4d: %8lld (%3lld%%)",
-		  i, fCount[i], (fCount[i] * 100L) / iCount);
-	  if  ( ( i % 4) == 3 ) fputc('\n', diag);
-	}
-       fprintf(diag, "%lld instructions executed in ", iCount);
-       printTime(emTime);
-       fprintf(diag, " of simulated time\n");
-     }
-
-  tidyExit(exitCode);
+      const DECODED *op = &decoded[start + i];
+      const INT32 addr  = ( op->bMod ? op->a + store[bReg] : op->a ) & MASK16;
+      if  ( (addr >= STORE_SIZE) || (addr == scReg) || (store[addr] >= BIT18) ) return -1;
+      add  += store[addr];
+      time += op->bMod ? 29 : 23;
+    }
+  if  ( (add == 0) || (add > BIT17) ) return -1; // A would not become positive directly
+
+  // iterations needed for A to become positive, less the last
+  INT64 skip = (BIT19 - aReg + add - 1) / add - 1;
+  if  ( skip > (limit - iCount) / length ) skip = (limit - iCount) / length;
+  if  ( skip <= 0 ) return -1;
+  aReg       = (aReg + skip * add) & MASK18;
+  iCount    += skip * length;
+  emTime    += skip * time;
+  fCount[1] += skip * (length - 1);
+  fCount[9] += skip;
+  lastSCR    = start + length - 1;
+  loopCount += skip;
+  return -1;
 }
 
-void checkAddress(INT32 addr)
-{
-  if   ( addr >= STORE_SIZE )
-        {
-	  flushTTY();
-          fprintf(diag, "*** Address outside of available store (%d)\n", addr);
-  	  tidyExit(EXIT_FAILURE);
-        }
+void uncache (INT32 addr) {
+  decoded[addr].valid = FALSE;
+  for ( INT32 start = ( addr >= MAX_BLOCK ) ? addr - MAX_BLOCK + 1 : 0 ;
+	start <= addr ; start++ )
+    if  ( start + blockLength[start] > addr )
+      {
+	blockLength[start] = 0;
+	blockLoop[start]   = 0;
+#ifdef JIT
+	jitCode[start] = NULL;
+	jitHits[start] = 0;
+#endif
+      }
+  cached[addr] = FALSE;
 }
 
-
+#ifdef JIT
 /**********************************************************/
-/*              STORE DUMP AND RECOVERY                   */
+/*          NATIVE CODE TRANSLATION (x86-64 only)         */
 /**********************************************************/
 
- 
-void clearStore() {
-  for ( INT32 i = 0 ; i < STORE_SIZE ; i++ ) store[i] = 0;
-  if  ( verbose & 1 )
-    fprintf(diag, "Store (%d words) cleared\n", STORE_SIZE);
+
+// Blocks executed JIT_THRESHOLD times by the block engine are translated into
+// x86-64 code.  While translated code runs A and Q are held in r12 and r13,
+// emTime in r15, the address of the store in rbx, of cached[] in r14 and of
+// the current SCR word in rbp.  Translation stops short of any instruction the
+// interpreter must handle (input/output, B modified shifts, writes to an SCR
+// word or the initial instructions, addresses outside the store).  Writes to
+// words holding decoded or translated code call uncache() as storeWrite() does.
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+#define NOREG -1
+
+#define CC_B  0x2 // condition codes for jitJump
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_L  0xc
+#define CC_G  0xf
+#define CC_ALWAYS -1
+
+#define FIX_AFTER 0 // exit after instruction
+#define FIX_BAIL  1 // exit before instruction, to be interpreted
+#define FIX_WRITE 2 // write to cached word
+
+typedef struct {
+  unsigned char *at;     // rel32 to patch
+  INT32 kind;            // FIX_...
+  INT32 n;               // instruction index within block
+  INT32 reg;             // register holding address written, NOREG if constant
+  INT32 addr;            // address written if constant
+  unsigned char *resume; // where to continue after FIX_WRITE
+} JITFIX;
+
+#define MAX_FIX (8 * MAX_BLOCK)
+JITFIX jitFix[MAX_FIX];
+INT32  jitFixes;
+unsigned char *jp;       // code emission pointer
+
+void jitByte (INT32 b) { *jp++ = (unsigned char) b; }
+void jitWord (INT32 w) { memcpy(jp, &w, 4); jp += 4; }
+void jitQuad (INT64 q) { memcpy(jp, &q, 8); jp += 8; }
+
+void jitRex (INT32 w, INT32 reg, INT32 index, INT32 base) {
+  const INT32 rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+  if  ( rex != 0x40 ) jitByte(rex);
 }
 
-void readStore () {
-  FILE *f  = fopen(storePath, "r");
-  if   ( f != NULL )
-    {
-      // read store image from file
-      INT32 i = 0, n, c;
-      while ( (c = fscanf(f, "%d", &n)) == 1 )
-	{
-	  if  ( i >= STORE_SIZE )
-	    {
-	      fprintf(stderr, "*** %s exceeds store capacity (%d)\n", storePath, STORE_SIZE);
-	      exit(EXIT_FAILURE);
-	      /* NOT REACHED */
-	    }
-	  else store[i++] = n;
-	} // while
-      if ( c == 0 )
- 	{
-	  fprintf(stderr, "*** Format error in file %s\n", storePath);
-	  exit(EXIT_FAILURE);
-	  /* NOT REACHED */
-        }
-      else if ( ferror(f) )
-	{
-	  fprintf(stderr, "*** Error while reading %s", storePath);
-	  perror(" - ");
-	  exit(EXIT_FAILURE);
-	  /* NOT REACHED */
-        }
-      fclose(f); // N.B. store file gets re-opened for writing at end of execution
-      if   ( verbose & 1 )
-	fprintf(diag, "%d words read in from %s\n", i, storePath);
-    }
-  else if  ( verbose & 1 ) 
-    fprintf (diag, "No %s file found, store left empty\n", storePath);
+void jitOpcode (INT32 op) {
+  if  ( op > 0xff ) jitByte(op >> 8);
+  jitByte(op & 0xff);
+}
 
-  storeValid = TRUE;
+// op reg, [base + index << scale + disp]
+void jitMem (INT32 w, INT32 op, INT32 reg, INT32 base, INT32 index, INT32 scale, INT32 disp) {
+  jitRex(w, reg & 15, ( index == NOREG ) ? 0 : index, base);
+  jitOpcode(op);
+  jitByte(0x84 | ((reg & 7) << 3)); // disp32 with SIB byte
+  jitByte((scale << 6) | ((( index == NOREG ) ? 4 : index & 7) << 3) | (base & 7));
+  jitWord(disp);
 }
 
-void writeStore () {
-   FILE *f = fopen(storePath, "w");
-   if  ( f == NULL ) {
-     fprintf(stderr, ERR_FOPEN_STORE_FILE);
-     perror(storePath);
-      exit(EXIT_FAILURE);
-      /* NOT REACHED */ }
-   for ( INT32 i = 0 ; i < STORE_SIZE ; ++i )
-     {
-       fprintf(f, "%7d", store[i]);
-       if  ( ((i%10) == 0) && (i!=0) ) fputc('\n', f);
-     }
-   if  ( verbose & 1 )
-	 fprintf(diag, "%d words written out to %s\n", STORE_SIZE, storePath);
-   fclose(f);
+// op reg, rm
+void jitReg (INT32 w, INT32 op, INT32 reg, INT32 rm) {
+  jitRex(w, reg & 15, 0, rm);
+  jitOpcode(op);
+  jitByte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void jitMovImm64 (INT32 r, INT64 imm) { // movabs r, imm
+  jitRex(1, 0, 0, r);
+  jitByte(0xb8 + (r & 7));
+  jitQuad(imm);
+}
+
+void jitRegImm (INT32 w, INT32 digit, INT32 r, INT32 imm) { // add/or/and/sub/cmp r, imm32
+  jitReg(w, 0x81, digit, r);
+  jitWord(imm);
+}
+
+void jitShift (INT32 w, INT32 digit, INT32 r, INT32 n) { // shl/shr/sar r, n
+  jitReg(w, 0xc1, digit, r);
+  jitByte(n);
+}
+
+void jitSignExtend (INT32 r) { // sign extend 18 bit value in r to 64 bits
+  jitShift(1, 4, r, 46);
+  jitShift(1, 7, r, 46);
+}
+
+void jitAddTime (INT32 us) { // add r15, us
+  if  ( us != 0 ) jitRegImm(1, 0, R15, us);
+}
+
+unsigned char *jitJump (INT32 cc) { // jcc/jmp rel32, returning where to patch
+  if  ( cc == CC_ALWAYS )
+    jitByte(0xe9);
+  else
+    {
+      jitByte(0x0f);
+      jitByte(0x80 | cc);
+    }
+  jitWord(0);
+  return jp - 4;
+}
+
+void jitPatch (unsigned char *at, unsigned char *target) {
+  const INT32 rel = (INT32) (target - (at + 4));
+  memcpy(at, &rel, 4);
+}
+
+void jitFixup (unsigned char *at, INT32 kind, INT32 n, INT32 reg, INT32 addr) {
+  JITFIX *fix = &jitFix[jitFixes++];
+  fix->at   = at;
+  fix->kind = kind;
+  fix->n    = n;
+  fix->reg  = reg;
+  fix->addr = addr;
+  fix->resume = jp;
+}
+
+void jitVar (INT32 op, INT32 reg, void *var, INT32 w) { // op reg, [var] via rax
+  jitMovImm64(RAX, (INT64) var);
+  jitMem(w, op, reg, RAX, NOREG, 0, 0);
+}
+
+void jitPrologue () {
+  static const INT32 saved[] = { RBX, RBP, R12, R13, R14, R15 };
+  for ( INT32 i = 0 ; i < 6 ; i++ )
+    {
+      if  ( saved[i] >= 8 ) jitByte(0x41);
+      jitByte(0x50 + (saved[i] & 7));
+    }
+  jitRegImm(1, 5, 4, 8);                  // sub rsp, 8 to align stack for calls
+  jitMovImm64(RBX, (INT64) store);
+  jitVar(0x63, RAX, &scReg, 1);           // movsxd rax, [scReg]
+  jitMem(1, 0x8d, RBP, RBX, RAX, 2, 0);   // lea rbp, [rbx + rax*4]
+  jitVar(0x8b, R12, &aReg, 0);
+  jitVar(0x8b, R13, &qReg, 0);
+  jitVar(0x8b, R15, &emTime, 1);
+  jitMovImm64(R14, (INT64) cached);
+}
+
+// Leave translated code having completed n instructions of the block at start.
+void jitExit (INT32 start, INT32 n, INT32 bail) {
+  static const INT32 saved[] = { R15, R14, R13, R12, RBP, RBX };
+  INT32 counts[16] = { 0 };
+  if  ( n > 0 )
+    {
+      jitMovImm64(RAX, (INT64) &iCount);
+      jitMem(1, 0x81, 0, RAX, NOREG, 0, 0); jitWord(n);           // add [iCount], n
+      for ( INT32 i = 0 ; i < n ; i++ ) counts[decoded[start + i].f]++;
+      for ( INT32 i = 0 ; i < 16 ; i++ )
+	if  ( counts[i] )
+	  {
+	    jitMovImm64(RAX, (INT64) &fCount[i]);
+	    jitMem(1, 0x81, 0, RAX, NOREG, 0, 0); jitWord(counts[i]);
+	  }
+      jitMovImm64(RAX, (INT64) &lastSCR);
+      jitMem(0, 0xc7, 0, RAX, NOREG, 0, 0); jitWord(start + n - 1); // mov [lastSCR], imm
+    }
+  jitVar(0x89, R12, &aReg, 0);
+  jitVar(0x89, R13, &qReg, 0);
+  jitVar(0x89, R15, &emTime, 1);
+  if  ( bail )
+    {
+      jitMem(0, 0xc7, 0, RBP, NOREG, 0, 0); jitWord(start + n); // SCR to instruction n
+      jitByte(0xb8); jitWord(JIT_BAIL);                         // mov eax, JIT_BAIL
+    }
+  else
+    { // JIT_DYNSTOP if SCR now points at last instruction executed
+      jitReg(0, 0x31, RAX, RAX);                                // xor eax, eax
+      jitMem(0, 0x81, 7, RBP, NOREG, 0, 0); jitWord(start + n - 1);
+      jitByte(0x0f); jitByte(0x94); jitByte(0xc0);              // sete al
+    }
+  jitRegImm(1, 0, 4, 8);                                        // add rsp, 8
+  for ( INT32 i = 0 ; i < 6 ; i++ )
+    {
+      if  ( saved[i] >= 8 ) jitByte(0x41);
+      jitByte(0x58 + (saved[i] & 7));
+    }
+  jitByte(0xc3);                                                // ret
+}
+
+// Store ecx at m (in rdx if reg is RDX, else addr), calling uncache() if needed.
+void jitStore (INT32 n, INT32 valueReg, INT32 reg, INT32 addr) {
+  if  ( reg == NOREG )
+    {
+      jitMem(0, 0x89, valueReg, RBX, NOREG, 0, addr * 4);
+      jitMem(0, 0x80, 7, R14, NOREG, 0, addr); jitByte(0);     // cmp byte [r14+addr], 0
+    }
+  else
+    {
+      jitMem(0, 0x89, valueReg, RBX, reg, 2, 0);
+      jitMem(0, 0x80, 7, R14, reg, 0, 0); jitByte(0);
+    }
+  unsigned char *at = jitJump(CC_NE);
+  jitFixup(at, FIX_WRITE, n, reg, addr);
+}
+
+// Translate instruction n of block at start, returning FALSE if it cannot be.
+INT32 jitInstruction (INT32 start, INT32 n) {
+  const DECODED *d = &decoded[start + n];
+  const INT32 f = d->f, bMod = d->bMod, ma = d->a & MASK16;
+  const INT32 places = ma & ADDR_MASK;
+  const INT32 m = bMod ? RDX : NOREG; // register holding m, else m is ma
+  unsigned char *at, *at2;
+
+  // reject what only the interpreter handles
+  if  ( f == 15 ) return FALSE;
+  if  ( (f == 14) && (bMod || ((places > 2047) && (places < 6144))) ) return FALSE;
+  if  ( !bMod && (f != 7) && (f != 8) && (f != 9) && (f != 14) )
+    {
+      if  ( ma >= STORE_SIZE ) return FALSE;
+      if  ( ((f == 3) || (f == 5) || (f == 10) || (f == 11)) &&
+	    ((ma == SCRLEVEL1) || (ma == SCRLEVEL4)) ) return FALSE;
+      if  ( (f == 5) && (ma >= 8180) && (ma <= 8191) ) return FALSE;
+    }
+
+  jitMem(0, 0xc7, 0, RBP, NOREG, 0, 0); jitWord(start + n + 1); // step SCR
+
+  if  ( bMod )
+    { // edx = (a + store[bReg]) & MASK16, checked as interpreter would
+      jitVar(0x63, RAX, &bReg, 1);
+      jitMem(0, 0x8b, RDX, RBX, RAX, 2, 0);
+      jitRegImm(0, 0, RDX, d->a);
+      jitRegImm(0, 4, RDX, MASK16);
+      if  ( (f != 7) && (f != 8) && (f != 9) )
+	{
+	  jitRegImm(0, 7, RDX, STORE_SIZE);
+	  jitFixup(jitJump(CC_AE), FIX_BAIL, n, NOREG, 0);
+	}
+      if  ( f == 5 ) // level 1 protection of initial instructions
+	{
+	  jitRegImm(0, 7, RDX, 8180);
+	  at = jitJump(CC_B);
+	  jitRegImm(0, 7, RDX, 8191);
+	  at2 = jitJump(CC_A);
+	  jitVar(0x81, 7, &level, 0); jitWord(1);                  // cmp [level], 1
+	  jitFixup(jitJump(CC_E), FIX_BAIL, n, NOREG, 0);
+	  jitPatch(at, jp);
+	  jitPatch(at2, jp);
+	}
+      jitAddTime(6);
+    }
+
+  // ecx = store[m] for functions that read it
+  if  ( (f <= 2) || (f == 4) || (f == 6) || (f == 10) || (f == 12) || (f == 13) )
+    {
+      if  ( bMod )
+	jitMem(0, 0x8b, RCX, RBX, RDX, 2, 0);
+      else
+	jitMem(0, 0x8b, RCX, RBX, NOREG, 0, ma * 4);
+    }
+
+  switch ( f )
+    {
+      case 0: // Load B
+	jitReg(0, 0x8b, R13, RCX);
+	jitAddTime(30);
+	jitVar(0x63, RAX, &bReg, 1);
+	jitStore(n, R13, RAX, 0);
+	return TRUE;
+
+      case 1: // Add
+	jitReg(0, 0x03, R12, RCX);
+	jitRegImm(0, 4, R12, MASK18);
+	jitAddTime(23);
+	return TRUE;
+
+      case 2: // Negate and add
+	jitReg(0, 0x2b, RCX, R12);
+	jitRegImm(0, 4, RCX, MASK18);
+	jitReg(0, 0x8b, R12, RCX);
+	jitAddTime(26);
+	return TRUE;
+
+      case 3: // Store Q
+	jitReg(0, 0x8b, RCX, R13);
+	jitShift(0, 7, RCX, 1);
+	jitAddTime(25);
+	jitStore(n, RCX, m, ma);
+	break;
+
+      case 4: // Load A
+	jitReg(0, 0x8b, R12, RCX);
+	jitAddTime(23);
+	return TRUE;
+
+      case 5: // Store A
+	jitAddTime(25);
+	jitStore(n, R12, m, ma);
+	break;
+
+      case 6: // Collate
+	jitReg(0, 0x23, R12, RCX);
+	jitAddTime(23);
+	return TRUE;
+
+      case 7: // Jump if zero
+	jitReg(0, 0x85, R12, R12);
+	at = jitJump(CC_NE);
+	if  ( bMod ) jitMem(0, 0x89, RDX, RBP, NOREG, 0, 0);
+	else       { jitMem(0, 0xc7, 0, RBP, NOREG, 0, 0); jitWord(ma); }
+	jitAddTime(28 + 20);
+	at2 = jitJump(CC_ALWAYS);
+	jitPatch(at, jp);
+	jitAddTime(21);
+	jitReg(0, 0x85, R12, R12);
+	unsigned char *at3 = jitJump(CC_G);
+	jitAddTime(-1);
+	jitPatch(at3, jp);
+	jitPatch(at2, jp);
+	return TRUE;
+
+      case 8: // Jump unconditional
+	if  ( bMod ) jitMem(0, 0x89, RDX, RBP, NOREG, 0, 0);
+	else       { jitMem(0, 0xc7, 0, RBP, NOREG, 0, 0); jitWord(ma); }
+	jitAddTime(23);
+	return TRUE;
+
+      case 9: // Jump if negative
+	jitRegImm(0, 7, R12, BIT18);
+	at = jitJump(CC_L);
+	if  ( bMod ) jitMem(0, 0x89, RDX, RBP, NOREG, 0, 0);
+	else       { jitMem(0, 0xc7, 0, RBP, NOREG, 0, 0); jitWord(ma); }
+	jitAddTime(25);
+	jitPatch(at, jp);
+	jitAddTime(20);
+	return TRUE;
+
+      case 10: // Increment in store
+	jitRegImm(0, 0, RCX, 1);
+	jitRegImm(0, 4, RCX, MASK18);
+	jitAddTime(24);
+	jitStore(n, RCX, m, ma);
+	break;
+
+      case 11: // Store S
+	jitByte(0x41); jitByte(0xb8 + (R13 & 7)); jitWord((start + n + 1) & MOD_MASK);
+	jitByte(0xb8 + RCX); jitWord((start + n + 1) & ADDR_MASK);
+	jitAddTime(30);
+	jitStore(n, RCX, m, ma);
+	break;
+
+      case 12: // Multiply
+	jitReg(0, 0x8b, RAX, R12);
+	jitSignExtend(RAX);                // al
+	jitReg(1, 0x8b, RDI, RAX);
+	jitReg(0, 0x8b, RSI, RCX);
+	jitSignExtend(RSI);                // sl
+	jitReg(1, 0x0faf, RAX, RSI);       // prod = al * sl
+	jitReg(1, 0x8b, RCX, RAX);
+	jitShift(1, 4, RCX, 1);
+	jitRegImm(0, 4, RCX, MASK18);
+	jitShift(1, 5, RDI, 63);           // 1 if al < 0
+	jitReg(0, 0x0b, RCX, RDI);
+	jitReg(0, 0x8b, R13, RCX);
+	jitShift(1, 7, RAX, 17);
+	jitRegImm(0, 4, RAX, MASK18);
+	jitReg(0, 0x8b, R12, RAX);
+	jitAddTime(79);
+	return TRUE;
+
+      case 13: // Divide
+	jitReg(0, 0x8b, RAX, R12);
+	jitSignExtend(RAX);
+	jitShift(1, 4, RAX, 18);
+	jitReg(0, 0x8b, RSI, R13);
+	jitReg(1, 0x0b, RAX, RSI);         // aql
+	jitReg(0, 0x8b, RSI, RCX);
+	jitSignExtend(RSI);                // ml
+	jitByte(0x48); jitByte(0x99);      // cqo
+	jitReg(1, 0xf7, 7, RSI);           // idiv rsi
+	jitShift(1, 7, RAX, 1);
+	jitRegImm(0, 4, RAX, MASK18);
+	jitReg(0, 0x8b, RCX, RAX);
+	jitRegImm(0, 1, RCX, 1);
+	jitReg(0, 0x8b, R12, RCX);
+	jitRegImm(0, 4, RAX, 0777776);
+	jitReg(0, 0x8b, R13, RAX);
+	jitAddTime(79);
+	return TRUE;
+
+      case 14: // Shift
+	{
+	  const INT32 left  = places <= 2047;
+	  const INT32 count = left ? places : 8192 - places;
+	  jitReg(0, 0x8b, RAX, R12);
+	  jitSignExtend(RAX);
+	  jitShift(1, 4, RAX, 18);
+	  jitReg(0, 0x8b, RSI, R13);
+	  jitReg(1, 0x0b, RAX, RSI);       // aql
+	  if  ( count > 0 ) jitShift(1, left ? 4 : 7, RAX, ( count >= 36 ) ? 36 : count);
+	  jitReg(0, 0x8b, RCX, RAX);
+	  jitRegImm(0, 4, RCX, MASK18);
+	  jitReg(0, 0x8b, R13, RCX);
+	  jitShift(1, 7, RAX, 18);
+	  jitRegImm(0, 4, RAX, MASK18);
+	  jitReg(0, 0x8b, R12, RAX);
+	  jitAddTime(24 + 7 * count);
+	  return TRUE;
+	}
+    }
+
+  // after a store to a computed address, leave if it changed the SCR word
+  if  ( bMod )
+    {
+      jitMem(0, 0x81, 7, RBP, NOREG, 0, 0); jitWord(start + n + 1);
+      jitFixup(jitJump(CC_NE), FIX_AFTER, n, NOREG, 0);
+    }
+  return TRUE;
+}
+
+// Called from translated code on writing to a cached word: returns TRUE if
+// the block being executed has been overwritten.
+INT32 jitUncache (INT32 addr, INT32 start) {
+  uncache(addr);
+  return blockLength[start] == 0;
+}
+
+void jitTranslate (INT32 start, INT32 length) {
+  INT32 n;
+  if  ( jitBuffer == NULL )
+    {
+      jitBuffer = mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if  ( jitBuffer == MAP_FAILED )
+	{
+	  if  ( verbose & 1 )
+	    fprintf(diag, "Cannot allocate native code buffer, using block engine\n");
+	  jitBuffer = NULL;
+	  engine = ENGINE_BLOCK;
+	  return;
+	}
+      jitPtr = jitBuffer;
+    }
+  if  ( jitBuffer + JIT_SIZE - jitPtr < JIT_MARGIN ) // buffer full, start again
+    {
+      memset(jitCode, 0, sizeof(jitCode));
+      memset(jitHits, 0, sizeof(jitHits));
+      jitPtr = jitBuffer;
+    }
+
+  jp = jitPtr;
+  jitFixes = 0;
+  jitPrologue();
+  for ( n = 0 ; (n < length) && jitInstruction(start, n) ; n++ ) ;
+  if  ( n == 0 ) return; // nothing translatable
+  jitExit(start, n, FALSE);
+
+  // out of line code for exits and writes to cached words
+  for ( INT32 i = 0 ; i < jitFixes ; i++ )
+    {
+      const JITFIX *fix = &jitFix[i];
+      jitPatch(fix->at, jp);
+      switch ( fix->kind )
+	{
+	  case FIX_AFTER:
+	    jitExit(start, fix->n + 1, FALSE);
+	    break;
+
+	  case FIX_BAIL:
+	    jitExit(start, fix->n, TRUE);
+	    break;
+
+	  case FIX_WRITE:
+	    if  ( fix->reg == NOREG )
+	      { jitByte(0xb8 + RDI); jitWord(fix->addr); }          // mov edi, addr
+	    else
+	      jitReg(0, 0x8b, RDI, fix->reg);                      // mov edi, reg
+	    jitByte(0xb8 + RSI); jitWord(start);                   // mov esi, start
+	    jitMovImm64(RAX, (INT64) jitUncache);
+	    jitByte(0xff); jitByte(0xd0);                          // call rax
+	    jitReg(0, 0x85, RAX, RAX);
+	    unsigned char *at = jitJump(CC_E);
+	    jitExit(start, fix->n + 1, FALSE);
+	    jitPatch(at, jp);
+	    jitPatch(jitJump(CC_ALWAYS), fix->resume);
+	}
+    }
+
+  jitCode[start]   = (JITCODE) jitPtr;
+  jitLength[start] = n;
+  jitCount++;
+  jitPtr = (unsigned char *) (((uintptr_t) jp + 15) & ~(uintptr_t) 15);
+}
+#endif
+
+
+INLINE void fetch () {
+  // increment SCR
+  ++iCount;
+  lastSCR = store[scReg];
+  store[scReg]++;
+  checkAddress(lastSCR);
+
+  // fetch instruction, decoding it only if not already done
+  const DECODED *dec = decoded[lastSCR].valid ? &decoded[lastSCR] : decode(lastSCR);
+  instruction = dec->instruction;
+  f = dec->f;
+  a = dec->a;
+  fCount[f]+=1; // track number of executions of each function code
+  remember();
+
+  // perform B modification if needed
+  if ( dec->bMod )
+    {
+      m = (a + store[bReg]) & MASK16;
+      emTime += 6;
+    }
+  else
+      m = a & MASK16;
+}
+
+INLINE INT32 endInstruction () { // returns exit code if machine stopped, else -1
+
+  if  ( profilePath != NULL ) profile();
+
+  // check to see if need to start diagnostic tracing
+  if   ( (lastSCR == diagFrom) || ( (diagCount != -1) && (iCount >= diagCount)) )
+    tracing = TRUE;
+  if   ( iCount == diagLimit )
+    {
+      tracing = TRUE;
+      abandon = iCount + 1000; // trace 1000 instructions
+    }
+
+  // print diagnostics if required
+  if   ( traceOne )
+    {
+      traceOne = FALSE; // dealt with single case
+      traceInstruction();
+    }
+  else if ( tracing && (verbose & 4) )
+    traceInstruction();
+
+  if   ( iCount >= nextSave ) saveState();
+
+  // check for limits
+  if   ( (abandon != -1) && (iCount >= abandon) )
+    {
+      flushTTY();
+      if  ( verbose & 1 ) fprintf(diag, "Instruction limit reached\n");
+      return EXIT_LIMITSTOP;
+    }
+
+  // check for dynamic stop
+  if   ( store[scReg] == lastSCR ) return dynamicStop();
+
+  // check for breakpoint on next instruction
+  if   ( breaking && ((store[scReg] & MASK16) < STORE_SIZE) &&
+	 BIT_TEST(breakBits, store[scReg] & MASK16) ) return breakpoint();
+
+  return -1; // carry on
+}
+
+void watchWrite (INT32 addr, INT32 value) { // called before value written to addr
+  if  ( !BIT_TEST(watchBits, addr) || (store[addr] == value) ) return;
+  fprintf(diag, "Monitored location ");
+  printAddr(diag, addr);
+  fprintf(diag, " changed from %d to %d\n", store[addr], value);
+  traceOne = TRUE;
+}
+
+INT32 breakpoint () { // stop before next instruction, saving state to carry on from
+  flushTTY();
+  fprintf(diag, "Breakpoint at ");
+  printAddr(diag, store[scReg]);
+  fprintf(diag, " after %lld instructions\n", (long long) iCount);
+  writeCheckpoint();
+  return EXIT_BREAKSTOP;
+}
+
+INT32 fastStop () { // dynamic stop seen by a fast loop
+  // the instruction limit is checked first, as in endInstruction(); returning
+  // -1 leaves execute() to report it
+  if   ( (abandon != -1) && (iCount >= abandon) ) return -1;
+  return dynamicStop();
+}
+
+INT32 dynamicStop () { // report dynamic stop at lastSCR
+  FILE *stop; // used to open stopFile
+  flushTTY();
+  if   ( verbose & 1 )
+    {
+      fprintf(diag, "Dynamic stop at ");
+      printAddr(diag, lastSCR);
+      fputc('\n', diag);
+    }
+  if ( (stop = fopen(STOP_FILE, "w")) == NULL )
+    {
+      fprintf(stderr, ERR_FOPEN_STOP_FILE);
+      perror(STOP_FILE);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  fprintf(stop, "%d", lastSCR);
+  fclose(stop);
+  return EXIT_DYNSTOP;
+}
+
+INLINE void traceInstruction () { // trace current instruction to diag or trace file
+  if  ( traceFile == NULL )
+    {
+      flushTTY();
+      printDiagnostics(instruction, f, a);
+      return;
+    }
+  TRACE *t = &traceBuffer[traceCount++];
+  t->iCount      = iCount;
+  t->scr         = lastSCR;
+  t->instruction = instruction;
+  t->a           = a;
+  t->aReg        = aReg;
+  t->qReg        = qReg;
+  t->b           = store[bReg];
+  if  ( traceCount == TRACE_BUFFER ) flushTrace();
+}
+
+INLINE void remember () { // record instruction about to be executed in history
+  // slot chosen by count, and with -history=0 the ring has one slot, so no tests
+  history[iCount & historyMask] = HISTORY(iCount, instruction, lastSCR);
+}
+
+void writeHistory () { // write history as a trace file, registers as after execution
+  const INT32 size  = historyMask + 1;
+  const INT32 version = TRACE_VERSION;
+  INT32 n = 0;
+  TRACE *trace;
+  FILE *f;
+  if  ( (historySize <= 0) || (iCount == 0) ) return;
+  if  ( ((trace = malloc(size * sizeof(TRACE))) == NULL) ||
+	((f = fopen(HISTORY_FILE, "wb")) == NULL) )
+    {
+      fprintf(stderr, "*** Cannot open history file ");
+      perror(HISTORY_FILE);
+      return;
+    }
+  fwrite(TRACE_MAGIC, 1, 4, f);
+  fwrite(&version, sizeof(version), 1, f);
+  for ( INT32 i = 0 ; i < size ; i++ )
+    {
+      const uint64_t h = history[i];
+      TRACE t;
+      if  ( h == 0 ) continue; // not yet filled
+      // count holds the low 31 bits of the instruction count
+      t.iCount      = iCount - ((iCount - (INT64) (h >> 33)) & 0x7FFFFFFF);
+      t.scr         = h & 16383;
+      t.instruction = (h >> 14) & 0777777;
+      t.a           = (t.instruction & ADDR_MASK) | (t.scr & MOD_MASK);
+      if  ( t.iCount == iCount )
+	{ // registers as after the last instruction
+	  t.aReg = aReg;
+	  t.qReg = qReg;
+	  t.b    = store[bReg];
+	}
+      else
+	t.aReg = t.qReg = t.b = -1; // not remembered
+      trace[n++] = t;
+    }
+  // gaps in the counts (native code, idle loops) can leave older records out of turn
+  qsort(trace, n, sizeof(TRACE), compareTrace);
+  fwrite(trace, sizeof(TRACE), n, f);
+  fclose(f);
+  free(trace);
+  fprintf(diag, "Last %d instructions written to %s\n", n, HISTORY_FILE);
+}
+
+INT32 compareTrace (const void *a, const void *b) { // oldest first
+  const INT64 x = ((const TRACE *) a)->iCount, y = ((const TRACE *) b)->iCount;
+  return ( x > y ) - ( x < y );
+}
+
+void flushTrace () {
+  if  ( fwrite(traceBuffer, sizeof(TRACE), traceCount, traceFile) != traceCount )
+    {
+      fprintf(stderr, "*** Error writing trace file ");
+      perror(tracePath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  traceCount = 0;
+}
+
+void profile () { // count instruction just executed, using f and m set by fetch()
+  execCount[lastSCR]++;
+  if  ( m >= STORE_SIZE ) return;
+  switch ( f )
+    {
+      case  0: readCount[m]++; writeCount[bReg]++; break;
+      case  1:
+      case  2:
+      case  4:
+      case  6:
+      case 12:
+      case 13: readCount[m]++; break;
+      case 10: readCount[m]++; writeCount[m]++; break;
+      case  5: if  ( (level == 1) && (m >= 8180) && (m <= 8191) ) break; // ignored
+      case  3:
+      case 11: writeCount[m]++;
+    }
+}
+
+/* Function code handlers - operate on instruction, f, a and m as set up by fetch() */
+
+INLINE void loadB () { // 0
+  checkAddress(m);
+  qReg = store[m]; storeWrite(bReg, qReg);
+  emTime += 30;
+}
+
+INLINE void add () { // 1
+  aReg = (aReg + store[m]) & MASK18;
+  emTime += 23;
+}
+
+INLINE void negateAdd () { // 2
+  checkAddress(m);
+  aReg = (store[m] - aReg) & MASK18;
+  emTime += 26;
+}
+
+INLINE void storeQ () { // 3
+  checkAddress(m);
+  storeWrite(m, qReg >> 1);
+  emTime += 25;
+}
+
+INLINE void loadA () { // 4
+  checkAddress(m);
+  aReg = store[m];
+  emTime += 23;
+}
+
+INLINE void storeA () { // 5
+  if   ( level == 1 && m >= 8180 && m <= 8191 )
+    {
+      if ( verbose & 1 )
+	fprintf(diag,
+		"Write to initial instructions ignored in priority level 1");
+    }
+  else
+    {
+      checkAddress(m);
+      storeWrite(m, aReg);
+    }
+  emTime += 25;
+}
+
+INLINE void collate () { // 6
+  checkAddress(m);
+  aReg &= store[m];
+  emTime += 23;
+}
+
+INLINE void jumpZero () { // 7
+  if   ( aReg == 0 )
+    {
+      traceOne = tracing && (verbose & 2);
+      store[scReg] = m;
+      emTime += 28;
+    }
+  if  ( aReg > 0 )
+    emTime += 21;
+  else
+    emTime += 20;
+}
+
+INLINE void jump () { // 8
+  store[scReg] = m;
+  emTime += 23;
+}
+
+INLINE void jumpNeg () { // 9
+  if   ( aReg >= BIT18 )
+    {
+      traceOne = tracing && (verbose & 2);
+      store[scReg] = m;
+      emTime += 25;
+    }
+  emTime += 20;
+}
+
+INLINE void increment () { // 10
+  checkAddress(m);
+  storeWrite(m, (store[m] + 1) & MASK18);
+  emTime += 24;
+}
+
+INLINE void storeS () { // 11
+  qReg = store[scReg] & MOD_MASK;
+  checkAddress(m);
+  storeWrite(m, store[scReg] & ADDR_MASK);
+  emTime += 30;
+}
+
+INLINE void multiply () { // 12
+  checkAddress(m);
+  // extend sign bits for a and store[m]
+  const INT64 al = (INT64) ( ( aReg >= BIT18 ) ? aReg - BIT19 : aReg );
+  const INT64 sl = (INT64) ( ( store[m] >= BIT18 ) ? store[m] - BIT19 : store[m] );
+  INT64  prod = al * sl;
+  qReg = (INT32) ((prod << 1) & MASK18 );
+  if   ( al < 0 ) qReg |= 1;
+  prod = prod >> 17; // arithmetic shift
+  aReg = (int) (prod & MASK18);
+  emTime += 79;
+}
+
+INLINE void divide () { // 13
+  checkAddress(m);
+  // extend sign bit for aq
+  const INT64 al   = (INT64) ( ( aReg >= BIT18 ) ? aReg - BIT19 : aReg ); // sign extend
+  const INT64 ql   = (INT64) qReg;
+  const INT64 aql  = (al << 18) | ql;
+  const INT64 ml   = (INT64) ( ( store[m] >= BIT18 ) ? store[m] - BIT19 : store[m] );
+  const INT64 quot = (( aql / ml) >> 1) & MASK18;
+  const INT32 q    = (INT32) quot;
+  aReg = q | 1;
+  qReg = q & 0777776;
+  emTime += 79;
+}
+
+INLINE void shift () { // 14 - assumes >> applied to a signed long or int is arithmetic
+  INT32       places = m & ADDR_MASK;
+  const INT64 al  = (INT64) ( ( aReg >= BIT18 ) ? aReg - BIT19 : aReg ); // sign extend
+  const INT64 ql  = qReg;
+  INT64       aql = (al << 18) | ql;
+
+  if   ( places <= 2047 )
+    {
+      emTime += (24 + 7 * places);
+      if   ( places >= 36 ) places = 36;
+      aql <<= places;
+    }
+  else if ( places >= 6144 )
+    { // right shift is arithmetic
+      places = 8192 - places;
+      emTime += (24 + 7 * places);
+      if ( places >= 36 ) places = 36;
+      aql >>= places;
+    }  
+  else
+    {
+      flushTTY();
+      fprintf(diag, "*** Unsupported i/o 14 i/o instruction\n");
+      printDiagnostics(instruction, f, a);
+      tidyExit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+
+  qReg = (int) (aql & MASK18);
+  aReg = (int) ((aql >> 18) & MASK18);
+}
+
+void inputOutput () { // 15
+  const INT32 z = m & ADDR_MASK;
+  switch   ( z )
+    {
+
+      case 2048: // read from tape reader
+	{ 
+	  const INT32 ch = readTape(); 
+	  aReg = ((aReg << 7) | ch) & MASK18;
+	  emTime += 4000; // assume 250 ch/s reader
+	  break;
+	}
+
+      case 2052: // read from teletype
+	{
+	  const INT32 ch = readTTY();
+	  aReg = ((aReg << 7) | ch) & MASK18;
+	  emTime += 100000; // assume 10 ch/s teletype
+	  break;
+	}
+
+      case 4864: // send to plotter
+	movePlotter(aReg);
+	if   (aReg >= 16 )
+	  {
+	    emTime += 20000;  // 20ms per step
+	  }
+	else
+	  {
+	    emTime += 3300;   // 3.3ms
+	  }		  
+	break;
+
+      case 6144: // write to paper tape punch 
+	punchTape(aReg & 255);
+	emTime += 9091; // assume 110 ch/s punch
+	break;
+
+      case 6148: // write to teletype
+	writeTTY(aReg & 255);
+	emTime += 100000; // assume 10 ch/s teletype
+	break;	      
+
+      case 7168:  // Level terminate
+	level = 4;
+	scReg = SCRLEVEL4;
+	bReg  = BREGLEVEL4;
+	emTime += 19;
+	break;
+
+      default:
+	flushTTY();
+	fprintf(diag, "*** Unsupported 15 i/o instruction\n");
+	printDiagnostics(instruction, f, a);
+	tidyExit(EXIT_FAILURE);
+	/* NOT REACHED */
+    } // end 15 switch
+}
+
+void checkAddress(INT32 addr)
+{
+  if   ( addr >= STORE_SIZE )
+        {
+	  flushTTY();
+          fprintf(diag, "*** Address outside of available store (%d)\n", addr);
+  	  tidyExit(EXIT_FAILURE);
+        }
+}
+
+
+/**********************************************************/
+/*                          JOBS                          */
+/**********************************************************/
+
+
+// A job file runs a sequence of stages, such as translate, library scan and run,
+// in a single process.  The store is kept in memory between stages and paper tapes
+// are passed between stages as in memory tapes.  Each line holds one command:
+//
+//    store FILE                   replace the store by the image in FILE
+//    tape NAME SOURCE             define tape NAME as a copy of SOURCE
+//    reverse NAME SOURCE          define tape NAME as SOURCE reversed
+//    run ADDRESS [reader=SOURCE] [ttyin=SOURCE] [>NAME]
+//                                 run from ADDRESS until the machine stops, with
+//                                 teletype output captured as tape NAME if given
+//    print NAME                   send tape NAME to teletype output
+//    echo [TEXT]                  send TEXT and a newline to teletype output
+//    write NAME FILE              write tape NAME to FILE
+//    stopif NAME [TEXT]           end the job if tape NAME contains TEXT (a line
+//                                 starting with TEXT if TEXT starts with ^, ending
+//                                 with it if TEXT ends with $, as for grep) or,
+//                                 if no TEXT, if tape NAME is not empty
+//    skipif NAME [TEXT]           as stopif but skip the next command
+//
+// A SOURCE is either *NAME for a tape or the name of a file.  Blank lines and
+// lines starting with # are ignored.  Tape *reader holds what would be in the
+// reader file between runs: initially the reader file, and after a stage that
+// reads paper tape the unread part of its input.  Tape *punch holds the output
+// of the most recent stage that punched.  At the end of the job the store, reader,
+// punch and plotter files are written as at the end of a single run.  The job
+// ends early if a stage fails.
+
+INT32 runJob () {
+  FILE *job = fopen(jobPath, "r");
+  char  line[1024];
+  INT32 lineNo = 0, skip = FALSE, exitCode = EXIT_SUCCESS;
+  TAPE *t;
+  if  ( job == NULL )
+    {
+      fprintf(stderr, "Cannot open job file ");
+      perror(jobPath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  if  ( (findTape("reader") == NULL) && (access(ptrPath, R_OK) == 0) )
+    copyTape("reader", sourceTape(ptrPath, 0), FALSE);
+
+  while ( fgets(line, sizeof(line), job) != NULL )
+    {
+      char *cmd, *name, *arg;
+      lineNo++;
+      if  ( ((cmd = strtok(line, " \t\n")) == NULL) || (cmd[0] == '#') ) continue;
+      if  ( skip )
+	{
+	  skip = FALSE;
+	  continue;
+	}
+      if  ( strcmp(cmd, "echo") == 0 )
+	{ // progress messages, as printed by the scripts jobs replace
+	  arg = strtok(NULL, "\n");
+	  while ( (arg != NULL) && isspace(*arg) ) arg++;
+	  fprintf(ttyoFile, "%s\n", ( arg == NULL ) ? "" : arg);
+	  continue;
+	}
+      name = strtok(NULL, " \t\n");
+      if  ( verbose & 1 )
+	fprintf(diag, "Job line %d: %s %s\n", lineNo, cmd, ( name == NULL ) ? "" : name);
+
+      if  ( strcmp(cmd, "run") == 0 )
+	{
+	  if  ( name == NULL ) jobError(lineNo, "missing address", cmd);
+	  arg = strtok(NULL, "\n");
+	  if  ( (exitCode = runJobStage(name, arg, lineNo)) == EXIT_FAILURE ) break;
+	  continue;
+	}
+      if  ( name == NULL ) jobError(lineNo, "missing argument", cmd);
+      arg = strtok(NULL, "\n");
+      while ( (arg != NULL) && isspace(*arg) ) arg++;
+      
+      if  ( strcmp(cmd, "store") == 0 )
+	{
+	  if  ( access(name, R_OK) != 0 ) jobError(lineNo, "cannot read store image", name);
+	  loadStoreImage(name);
+	}
+      else if ( (strcmp(cmd, "tape") == 0) || (strcmp(cmd, "reverse") == 0) )
+	{
+	  if  ( (arg == NULL) || (*arg == '\0') ) jobError(lineNo, "missing source", cmd);
+	  copyTape(name, sourceTape(strtok(arg, " \t"), lineNo), cmd[0] == 'r');
+	}
+      else if ( strcmp(cmd, "print") == 0 )
+	{
+	  t = sourceTape(name, lineNo);
+	  fwrite(t->data, 1, t->length, ttyoFile);
+	}
+      else if ( strcmp(cmd, "write") == 0 )
+	{
+	  if  ( arg == NULL ) jobError(lineNo, "missing file", cmd);
+	  writeTapeFile(sourceTape(name, lineNo), strtok(arg, " \t"));
+	}
+      else if ( (strcmp(cmd, "stopif") == 0) || (strcmp(cmd, "skipif") == 0) )
+	{
+	  INT32 found;
+	  t = sourceTape(name, lineNo);
+	  if  ( (arg == NULL) || (*arg == '\0') )
+	    found = t->length > 0;
+	  else
+	    { // search for text, ^ and $ anchoring it to start and end of a line
+	      const INT32  anchor = arg[0] == '^';
+	      size_t n = strlen(arg += anchor);
+	      const INT32  endAnchor = (n > 0) && (arg[n-1] == '$');
+	      n -= endAnchor;
+	      found = FALSE;
+	      for ( size_t i = 0 ; !found && (i + n <= t->length) ; i++ )
+		found = ( !anchor || (i == 0) || (t->data[i-1] == '\n') ) &&
+		        ( !endAnchor || (i + n == t->length) || (t->data[i+n] == '\n') ) &&
+		        (memcmp(&t->data[i], arg, n) == 0);
+	    }
+	  if  ( found && (cmd[1] == 't') ) break;
+	  skip = found;
+	}
+      else
+	jobError(lineNo, "unknown command", cmd);
+    }
+  fclose(job);
+
+  // leave reader and punch files as a sequence of single runs would
+  if  ( serving ) return exitCode; // output returned to client instead
+  if  ( (t = findTape("reader")) != NULL ) writeTapeFile(t, RDR_FILE);
+  if  ( (t = findTape("punch"))  != NULL ) writeTapeFile(t, punPath);
+  return exitCode;
+}
+
+INT32 runJobStage (char *address, char *args, INT32 lineNo) {
+  INT32 exitCode;
+  TAPE *rdr = findTape("reader"); // reader tape, NULL => read from reader file
+  char *output = NULL, *ttyPath = ttyInPath;
+  char *outData;                  // teletype output if captured
+  FILE *ttyo = ttyoFile;
+  size_t outLength;
+  const INT32 abandonLimit = abandon;
+  
+  // decode arguments
+  for ( char *arg = strtok(args, " \t") ; arg != NULL ; arg = strtok(NULL, " \t") )
+    if  ( strncmp(arg, "reader=", 7) == 0 )
+      rdr = sourceTape(arg + 7, lineNo);
+    else if ( strncmp(arg, "ttyin=", 6) == 0 )
+      {
+	if  ( arg[6] == '*' ) 
+	  {
+	    TAPE *t = sourceTape(arg + 6, lineNo);
+	    ttyiFile = fmemopen(t->data, t->length, "rb");
+	  }
+	else
+	  ttyInPath = arg + 6;
+      }
+    else if ( arg[0] == '>' )
+      output = arg + 1;
+    else
+      jobError(lineNo, "unknown argument", arg);
+  if  ( rdr != NULL )
+    { // read tape in place
+      ptrData   = (unsigned char *) rdr->data;
+      ptrLength = rdr->length;
+      ptrPos    = 0;
+      ptrMapped = FALSE;
+    }
+  if  ( output != NULL ) ttyoFile = open_memstream(&outData, &outLength);
+  
+  // run stage, returning here if it ends via tidyExit()
+  resetMachine();
+  jobStage = TRUE;
+  if  ( setjmp(jobEnv) == 0 )
+    exitCode = runStage(addtoi(address));
+  else
+    exitCode = jobExitCode;
+  jobStage = FALSE;
+  abandon = abandonLimit; // in case changed by -rtrace
+  flushTTY();
+  
+  // unread paper tape is left in reader
+  if  ( ptrData != NULL )
+    {
+      const size_t pos = ptrPos;
+      if  ( (rdr != NULL) && ((pos > 0) || (rdr == findTape("reader"))) )
+	{
+	  const size_t length = rdr->length - pos;
+	  char *data = malloc(length + 1);
+	  memcpy(data, rdr->data + pos, length);
+	  closeTape();
+	  setTape("reader", data, length);
+	}
+      else
+	closeTape();
+    }
+  if  ( ttyiFile != NULL )
+    {
+      fclose(ttyiFile);
+      ttyiFile = NULL;
+    }
+  ttyInPath = ttyPath;
+  if  ( punFile != NULL )
+    {
+      fclose(punFile);
+      punFile = NULL;
+      setTape("punch", punchData, punchLength);
+    }
+  if  ( output != NULL )
+    {
+      fclose(ttyoFile);
+      ttyoFile = ttyo;
+      setTape(output, outData, outLength);
+    }
+  return exitCode;
+}
+
+TAPE *findTape (char *name) {
+  for ( INT32 i = 0 ; i < MAX_TAPES ; i++ )
+    if  ( (tapes[i].name != NULL) && (strcmp(tapes[i].name, name) == 0) )
+      return &tapes[i];
+  return NULL;
+}
+
+TAPE *sourceTape (char *source, INT32 lineNo) {
+  TAPE *t;
+  if  ( source[0] == '*' )
+    {
+      if  ( (t = findTape(source + 1)) == NULL ) jobError(lineNo, "unknown tape", source);
+      return t;
+    }
+  struct stat st;
+  if  ( ((t = findTape(source)) != NULL) &&
+	(!t->fromFile || (stat(source, &st) != 0) ||
+	 ((st.st_mtime == t->mtime) && (st.st_size == t->size))) )
+    { // file already read in and unchanged since
+      t->used = ++tapeClock;
+      return t;
+    }
+  
+  // read file into tape named by file path
+  FILE *f = fopen(source, "rb");
+  if  ( (f == NULL) || (fstat(fileno(f), &st) != 0) ) jobError(lineNo, "cannot read", source);
+  char *data = malloc(st.st_size + 1);
+  if  ( (data == NULL) || (fread(data, 1, st.st_size, f) != st.st_size) )
+    jobError(lineNo, "cannot read", source);
+  fclose(f);
+  setTape(source, data, st.st_size);
+  t = findTape(source);
+  t->fromFile = TRUE;
+  t->mtime    = st.st_mtime;
+  t->size     = st.st_size;
+  t->used     = ++tapeClock;
+  return t;
+}
+
+void copyTape (char *name, TAPE *source, INT32 reversed) {
+  const size_t length = source->length;
+  char *data = malloc(length + 1);
+  if  ( data == NULL )
+    {
+      fprintf(stderr, "*** No memory for tape %s\n", name);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  if  ( reversed )
+    for ( size_t i = 0 ; i < length ; i++ ) data[i] = source->data[length - 1 - i];
+  else
+    memcpy(data, source->data, length);
+  setTape(name, data, length);
+}
+
+void setTape (char *name, char *data, size_t length) {
+  TAPE *t = findTape(name);
+  if  ( t == NULL )
+    {
+      for ( t = tapes ; (t < &tapes[MAX_TAPES]) && (t->name != NULL) ; t++ ) ;
+      if  ( t == &tapes[MAX_TAPES] )
+	{
+	  fprintf(stderr, "*** Too many tapes in job %s\n", jobPath);
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+      t->name = strdup(name);
+    }
+  else
+    free(t->data);
+  t->data     = data;
+  t->length   = length;
+  t->fromFile = FALSE;
+}
+
+void evictTape () { // free least recently used tape if server already has MAX_CACHED
+  TAPE  *oldest = NULL;
+  INT32  n = 0;
+  for ( TAPE *t = tapes ; t < &tapes[MAX_TAPES] ; t++ )
+    if  ( t->name != NULL )
+      {
+	n++;
+	if  ( (oldest == NULL) || (t->used < oldest->used) ) oldest = t;
+      }
+  if  ( n < MAX_CACHED ) return;
+  free(oldest->name);
+  free(oldest->data);
+  oldest->name = NULL;
+}
+
+void writeTapeFile (TAPE *t, char *path) {
+  FILE *f = fopen(path, "wb");
+  if  ( (f == NULL) || (fwrite(t->data, 1, t->length, f) != t->length) | fclose(f) )
+    {
+      fprintf(stderr, "*** Unable to write tape %s to ", t->name);
+      perror(path);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+}
+
+void loadStoreImage (char *path) {
+  IMAGE *im = images;
+  while ( (im < &images[imageCount]) && (strcmp(im->path, path) != 0) ) im++;
+  if  ( im < &images[imageCount] )
+    { // already read in
+      memcpy(store, im->words, sizeof(store));
+      resetCaches();
+      if  ( verbose & 1 ) fprintf(diag, "Store image %s reused\n", path);
+    }
+  else
+    {
+      char *save = storePath;
+      storePath = path;
+      clearStore();
+      readStore();
+      storePath = save;
+      if  ( imageCount < MAX_IMAGES )
+	{
+	  im->path = strdup(path);
+	  memcpy(im->words, store, sizeof(store));
+	  imageCount++;
+	}
+    }
+  storeImageValid = FALSE; // store file differs from image read
+}
+
+void jobError (INT32 lineNo, char *error, char *addl) {
+  fprintf(stderr, "*** %s line %d: %s %s\n", jobPath, lineNo, error, addl);
+  exit(EXIT_FAILURE);
+  /* NOT REACHED */
+}
+
+
+/**********************************************************/
+/*                      BATCH RUNS                        */
+/**********************************************************/
+
+
+// A batch manifest, named by -batch, lists independent runs, one per line, as a
+// directory followed by the arguments for emu900, e.g.,
+//
+//    work/prog1 -job=../../jobs/903algolajh.job
+//
+// Blank lines and lines starting with # are ignored.  Each run is a separate
+// process, started in its directory with teletype and diagnostic output sent to the
+// file .output there.  -workers runs are in progress at once, by default one per
+// processor.  Other options given with -batch apply to every run unless overridden
+// on its line.  A summary is printed when all have finished, ending with the
+// processor time the runs used and so how many processors were kept busy, and the
+// exit code is 0 only if all ended in a dynamic stop.
+
+void runBatch () {
+  FILE   *manifest = fopen(batchPath, "r");
+  char    line[1024];
+  BATCHRUN *runs = NULL;
+  INT32   n = 0, next = 0, running = 0, failed = 0;
+  double  start = seconds();
+  if  ( manifest == NULL )
+    {
+      fprintf(stderr, "Cannot open batch manifest ");
+      perror(batchPath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  while ( fgets(line, sizeof(line), manifest) != NULL )
+    {
+      char *p = line;
+      while ( isspace(*p) ) p++;
+      if  ( (*p == '\0') || (*p == '#') ) continue;
+      p[strcspn(p, "\n")] = '\0';
+      if  ( (runs = realloc(runs, (n + 1) * sizeof(BATCHRUN))) == NULL ||
+	    (runs[n].line = strdup(p)) == NULL )
+	{
+	  fprintf(stderr, "*** No memory for batch manifest\n");
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+      runs[n++].pid = 0;
+    }
+  fclose(manifest);
+  if  ( workers <= 0 ) workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if  ( workers <= 0 ) workers = 1;
+  if  ( verbose & 1 )
+    fprintf(diag, "%d runs in batch %s, %d at once\n", n, batchPath, workers);
+
+  // keep workers runs going until all done
+  while ( (next < n) || (running > 0) )
+    {
+      INT32 status;
+      pid_t pid;
+      while ( (running < workers) && (next < n) )
+	{
+	  BATCHRUN *r = &runs[next++];
+	  fflush(NULL); // nothing buffered to be output twice
+	  r->start = seconds();
+	  if  ( (r->pid = fork()) == 0 )
+	    startBatchRun(r->line); // NOT REACHED
+	  else if ( r->pid < 0 )
+	    {
+	      perror("*** Cannot start batch run");
+	      exit(EXIT_FAILURE);
+	      /* NOT REACHED */
+	    }
+	  running++;
+	}
+      if  ( (pid = wait(&status)) < 0 )
+	{
+	  perror("*** Waiting for batch run");
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+      for ( INT32 i = 0 ; i < n ; i++ )
+	if  ( runs[i].pid == pid )
+	  {
+	    runs[i].time     = seconds() - runs[i].start;
+	    runs[i].exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+	    if  ( runs[i].exitCode != EXIT_DYNSTOP ) failed++;
+	    running--;
+	  }
+    }
+
+  // summary, with processor time used to show how well runs overlapped
+  struct rusage usage;
+  const double elapsed = seconds() - start;
+  getrusage(RUSAGE_CHILDREN, &usage);
+  const double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                     usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  printf("Exit  Seconds  Run\n");
+  for ( INT32 i = 0 ; i < n ; i++ )
+    printf("%4d %8.3f  %s\n", runs[i].exitCode, runs[i].time, runs[i].line);
+  printf("%d runs, %d ended in dynamic stop, %d otherwise, in %.3f seconds\n",
+	 n, n - failed, failed, elapsed);
+  printf("%.3f processor seconds used, %.2f processors busy on average\n",
+	 cpu, ( elapsed > 0 ) ? cpu / elapsed : 0.0);
+  exit(( failed == 0 ) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void startBatchRun (char *line) { // in child process
+  const char *argv[64];
+  INT32 argc = 0;
+  char *dir = strtok(line, " \t");
+  argv[argc++] = "emu900";
+  while ( (argc < 63) && ((argv[argc] = strtok(NULL, " \t")) != NULL) ) argc++;
+  argv[argc] = NULL;
+  if  ( chdir(dir) != 0 )
+    {
+      fprintf(stderr, "*** Cannot change to directory of batch run ");
+      perror(dir);
+      _exit(EXIT_FAILURE);
+    }
+  if  ( freopen(BATCH_OUTPUT, "w", stdout) == NULL )
+    {
+      fprintf(stderr, "*** Cannot create %s in ", BATCH_OUTPUT);
+      perror(dir);
+      _exit(EXIT_FAILURE);
+    }
+  dup2(fileno(stdout), fileno(stderr));
+  setvbuf(stderr, NULL, _IONBF, 0);
+  batchPath = NULL;
+  decodeArgs(argc, argv);
+  emulate(); // does not return
+}
+
+double seconds () { // elapsed time
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**********************************************************/
+/*                     JOB SERVER                         */
+/**********************************************************/
+
+
+// With -serve emu900 listens on a Unix domain socket and runs a job for each
+// connection.  The store images and file tapes a job uses are read once by the
+// server and kept, so each job starts from a forked copy of the server with them
+// already in memory.  A tape is read again if its file has changed, and at most
+// MAX_CACHED tapes are kept, the least recently used being dropped to make room.
+// A job reads any tape not kept from its file as a single run does.  A job file given by -job is made ready before the first
+// connection.  emu900 -client=socket -job=file sends the reader file to the server
+// as the program tape and writes out the teletype, punch and plotter output returned.
+//
+// The client sends "JOB path\n" (the job file path as seen by the server) then
+// "TAPE n\n" and n characters of tape.  The server replies with sections "TTY n\n",
+// "PUNCH n\n" and "PLOT n\n", each followed by n characters, then "EXIT code\n".
+
+void serve () {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  const INT32 sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  strncpy(addr.sun_path, servePath, sizeof(addr.sun_path) - 1);
+  unlink(servePath);
+  if  ( (sock < 0) || (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+	(listen(sock, 16) != 0) )
+    {
+      fprintf(stderr, "*** Cannot listen on ");
+      perror(servePath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  signal(SIGCHLD, SIG_IGN); // no zombies
+  if  ( jobPath != NULL ) prepareJob(jobPath);
+  if  ( verbose & 1 ) fprintf(diag, "Serving jobs on %s\n", servePath);
+
+  for (;;)
+    {
+      char  path[1024];
+      const INT32 conn = accept(sock, NULL, NULL);
+      if  ( conn < 0 ) continue;
+      if  ( readLine(conn, path, sizeof(path)) && (strncmp(path, "JOB ", 4) == 0) )
+	{
+	  prepareJob(path + 4);
+	  fflush(NULL);
+	  if  ( fork() == 0 )
+	    {
+	      close(sock);
+	      serveJob(conn, path + 4); // NOT REACHED
+	    }
+	}
+      close(conn);
+    }
+}
+
+void prepareJob (char *path) { // read in store images and tapes used by job
+  FILE *job = fopen(path, "r");
+  char line[1024];
+  if  ( job == NULL ) return; // reported when job is run
+  while ( fgets(line, sizeof(line), job) != NULL )
+    {
+      char *cmd = strtok(line, " \t\n"), *arg;
+      if  ( cmd == NULL ) continue;
+      if  ( strcmp(cmd, "store") == 0 )
+	{
+	  if  ( ((arg = strtok(NULL, " \t\n")) != NULL) && (access(arg, R_OK) == 0) )
+	    loadStoreImage(arg);
+	}
+      else if ( (strcmp(cmd, "tape") == 0) || (strcmp(cmd, "reverse") == 0) ||
+		(strcmp(cmd, "run") == 0) )
+	while ( (arg = strtok(NULL, " \t\n")) != NULL )
+	  {
+	    if  ( strncmp(arg, "reader=", 7) == 0 ) arg += 7;
+	    if  ( (arg[0] == '*') || (access(arg, R_OK) != 0) ) continue;
+	    if  ( findTape(arg) == NULL ) evictTape();
+	    sourceTape(arg, 0); // or read again if file has changed
+	  }
+    }
+  fclose(job);
+  storeValid = FALSE; // the server never writes out the store
+}
+
+void serveJob (INT32 conn, char *path) { // in child process
+  FILE  *f = fdopen(conn, "r+");
+  char  *ttyData, *plotData = NULL;
+  size_t ttyLength, plotLength = 0, length;
+  INT32  exitCode;
+  if  ( (f == NULL) || (fscanf(f, "TAPE %zu", &length) != 1) || (fgetc(f) != '\n') )
+    _exit(EXIT_FAILURE);
+  char *data = malloc(length + 1);
+  if  ( (data == NULL) || (fread(data, 1, length, f) != length) ) _exit(EXIT_FAILURE);
+  setTape("reader", data, length);
+
+  // run job, capturing output
+  jobPath  = path;
+  serving  = TRUE;
+  ttyoFile = open_memstream(&ttyData, &ttyLength);
+  exitCode = runJob();
+  fclose(ttyoFile);
+  if  ( plotterTiles != NULL )
+    {
+      plotStream = open_memstream(&plotData, &plotLength);
+      savePlotterPaper();
+    }
+
+  // reply
+  TAPE *punch = findTape("punch");
+  fprintf(f, "TTY %zu\n", ttyLength);
+  fwrite(ttyData, 1, ttyLength, f);
+  if  ( punch != NULL )
+    {
+      fprintf(f, "PUNCH %zu\n", punch->length);
+      fwrite(punch->data, 1, punch->length, f);
+    }
+  if  ( plotData != NULL )
+    {
+      fprintf(f, "PLOT %zu\n", plotLength);
+      fwrite(plotData, 1, plotLength, f);
+    }
+  fprintf(f, "EXIT %d\n", exitCode);
+  fclose(f);
+  _exit(exitCode);
+}
+
+void runClient () {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  const INT32 sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  FILE  *f;
+  char   section[16];
+  size_t length;
+  INT32  exitCode = -1;
+  strncpy(addr.sun_path, clientPath, sizeof(addr.sun_path) - 1);
+  if  ( (sock < 0) || (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+	((f = fdopen(sock, "r+")) == NULL) )
+    {
+      fprintf(stderr, "*** Cannot connect to ");
+      perror(clientPath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  if  ( jobPath == NULL )
+    {
+      fprintf(stderr, "*** -client needs -job\n");
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+
+  // send job and reader file
+  TAPE *t = ( access(ptrPath, R_OK) == 0 ) ? sourceTape(ptrPath, 0) : NULL;
+  fprintf(f, "JOB %s\nTAPE %zu\n", jobPath, ( t == NULL ) ? 0 : t->length);
+  if  ( t != NULL ) fwrite(t->data, 1, t->length, f);
+  fflush(f);
+
+  // receive output
+  while ( fscanf(f, "%15s %zu", section, &length) == 2 )
+    {
+      char *data;
+      if  ( strcmp(section, "EXIT") == 0 )
+	{
+	  exitCode = length;
+	  break;
+	}
+      fgetc(f); // newline
+      if  ( ((data = malloc(length + 1)) == NULL) || (fread(data, 1, length, f) != length) )
+	break;
+      if  ( strcmp(section, "TTY") == 0 )
+	fwrite(data, 1, length, stdout);
+      else
+	{
+	  TAPE out = { section, data, length };
+	  writeTapeFile(&out, ( strcmp(section, "PUNCH") == 0 ) ? punPath : plotPath);
+	}
+      free(data);
+    }
+  fclose(f);
+  if  ( exitCode < 0 )
+    {
+      fprintf(stderr, "*** Job failed on server %s\n", clientPath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  exit(exitCode);
+}
+
+INT32 readLine (INT32 fd, char *line, INT32 size) { // read line without buffering ahead
+  INT32 n = 0;
+  char  ch;
+  while ( (n < size - 1) && (read(fd, &ch, 1) == 1) )
+    {
+      if  ( ch == '\n' )
+	{
+	  line[n] = '\0';
+	  return TRUE;
+	}
+      line[n++] = ch;
+    }
+  return FALSE;
+}
+
+
+/**********************************************************/
+/*              STORE DUMP AND RECOVERY                   */
+/**********************************************************/
+
+ 
+void clearStore() {
+  for ( INT32 i = 0 ; i < STORE_SIZE ; i++ ) store[i] = 0;
+  resetCaches();
+  if  ( verbose & 1 )
+    fprintf(diag, "Store (%d words) cleared\n", STORE_SIZE);
+}
+
+void resetCaches () {
+  memset(decoded, 0, sizeof(decoded)); // nothing decoded yet
+  memset(blockLength, 0, sizeof(blockLength));
+  memset(blockLoop, 0, sizeof(blockLoop));
+  memset(cached, 0, sizeof(cached));
+#ifdef JIT
+  memset(jitCode, 0, sizeof(jitCode));
+  memset(jitHits, 0, sizeof(jitHits));
+#endif
+}
+
+INLINE void storeWrite (INT32 addr, INT32 value) {
+  if  ( recordEvery > 0 ) logWrite(addr);
+  if  ( watching ) watchWrite(addr, value);
+  store[addr] = value;
+  if  ( cached[addr] ) uncache(addr);
+}
+
+DECODED *decode (INT32 addr) {
+  DECODED *d = &decoded[addr];
+  d->instruction = store[addr];
+  d->f           = (d->instruction >> FN_SHIFT) & FN_MASK;
+  d->a           = (d->instruction & ADDR_MASK) | (addr & MOD_MASK);
+  d->bMod        = d->instruction >= BIT18;
+  // the SCR words change on every instruction so are never cached
+  d->valid       = (addr != SCRLEVEL1) && (addr != SCRLEVEL4);
+  cached[addr]   = d->valid;
+  return d;
+}
+
+void readStore () {
+  if  ( readBinaryStore() )
+    {
+      storeValid = TRUE;
+      return;
+    }
+  FILE *f  = fopen(storePath, "r");
+  if   ( f != NULL )
+    {
+      // read store image from file
+      INT32 i = 0, n, c;
+      while ( (c = fscanf(f, "%d", &n)) == 1 )
+	{
+	  if  ( i >= STORE_SIZE )
+	    {
+	      fprintf(stderr, "*** %s exceeds store capacity (%d)\n", storePath, STORE_SIZE);
+	      exit(EXIT_FAILURE);
+	      /* NOT REACHED */
+	    }
+	  else store[i++] = n;
+	} // while
+      if ( c == 0 )
+ 	{
+	  fprintf(stderr, "*** Format error in file %s\n", storePath);
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+        }
+      else if ( ferror(f) )
+	{
+	  fprintf(stderr, "*** Error while reading %s", storePath);
+	  perror(" - ");
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+        }
+      fclose(f); // N.B. store file gets re-opened for writing at end of execution
+      if  ( (i == STORE_SIZE) && !storeBinary ) // else written out in a new form
+	{
+	  memcpy(storeImage, store, sizeof(storeImage));
+	  storeImageValid = TRUE;
+	}
+      if   ( verbose & 1 )
+	fprintf(diag, "%d words read in from %s\n", i, storePath);
+    }
+  else if  ( verbose & 1 ) 
+    fprintf (diag, "No %s file found, store left empty\n", storePath);
+
+  storeValid = TRUE;
+}
+
+INT32 readBinaryStore () {
+  struct stat st;
+  const INT32 fd = open(storePath, O_RDONLY);
+  if  ( fd < 0 ) return FALSE;
+  if  ( (fstat(fd, &st) != 0) || (st.st_size < sizeof(STOREHEADER)) )
+    {
+      close(fd);
+      return FALSE;
+    }
+  STOREHEADER *h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if  ( h == MAP_FAILED ) return FALSE;
+  if  ( memcmp(h->magic, STORE_MAGIC, 4) != 0 )
+    { // a text image
+      munmap(h, st.st_size);
+      return FALSE;
+    }
+  const INT32 *words = (const INT32 *) (h + 1);
+  if  ( (h->version != STORE_VERSION) || (h->words < 0) || (h->words > STORE_SIZE) ||
+	(st.st_size != sizeof(STOREHEADER) + h->words * sizeof(INT32)) ||
+	(storeChecksum(words, h->words) != h->checksum) )
+    {
+      fprintf(stderr, "*** Format error in binary store image %s\n", storePath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  memcpy(store, words, h->words * sizeof(INT32));
+  if  ( h->words == STORE_SIZE )
+    {
+      memcpy(storeImage, store, sizeof(storeImage));
+      storeImageValid = TRUE;
+    }
+  if   ( verbose & 1 )
+    fprintf(diag, "%d words read in from %s (binary)\n", h->words, storePath);
+  munmap(h, st.st_size);
+  storeBinary = TRUE; // write back in the same format
+  return TRUE;
+}
+
+uint32_t storeChecksum (const INT32 *words, INT32 n) {
+  uint32_t sum = 0;
+  for ( INT32 i = 0 ; i < n ; i++ )
+    sum = ((sum << 1) | (sum >> 31)) + (uint32_t) words[i];
+  return sum;
+}
+
+INT32 closeSynced (FILE *f) { // so a file renamed into place survives a host crash
+  INT32 failed = fflush(f) != 0;
+  failed |= fsync(fileno(f)) != 0;
+  failed |= ferror(f) != 0;
+  return fclose(f) | failed;
+}
+
+void writeStore () {
+   // compare with store as read in, skipping the write if no page has changed
+   INT32 pages = STORE_SIZE / STORE_PAGE;
+   if  ( storeImageValid )
+     {
+       pages = 0;
+       for ( INT32 p = 0 ; p < STORE_SIZE ; p += STORE_PAGE )
+	 if  ( memcmp(&store[p], &storeImage[p], STORE_PAGE * sizeof(INT32)) != 0 ) pages++;
+       if  ( pages == 0 )
+	 {
+	   if  ( verbose & 1 )
+	     fprintf(diag, "Store unchanged, %s not written\n", storePath);
+	   return;
+	 }
+     }
+
+   // write to a temporary file and rename it, so the image is never left half written
+   char tmpPath[strlen(storePath) + 5];
+   sprintf(tmpPath, "%s.tmp", storePath);
+   FILE *f = fopen(tmpPath, "w");
+   if  ( f == NULL ) {
+     fprintf(stderr, ERR_FOPEN_STORE_FILE);
+     perror(tmpPath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */ }
+   if  ( storeBinary )
+     {
+       STOREHEADER h;
+       memcpy(h.magic, STORE_MAGIC, 4);
+       h.version  = STORE_VERSION;
+       h.words    = STORE_SIZE;
+       h.checksum = storeChecksum(store, STORE_SIZE);
+       fwrite(&h, sizeof(h), 1, f);
+       fwrite(store, sizeof(INT32), STORE_SIZE, f);
+     }
+   else
+     for ( INT32 i = 0 ; i < STORE_SIZE ; ++i )
+       {
+	 fprintf(f, "%7d", store[i]);
+	 if  ( ((i%10) == 0) && (i!=0) ) fputc('\n', f);
+       }
+   if  ( closeSynced(f) || rename(tmpPath, storePath) )
+     {
+       fprintf(stderr, "*** Error while writing ");
+       perror(storePath);
+       remove(tmpPath);
+       exit(EXIT_FAILURE);
+       /* NOT REACHED */
+     }
+   if  ( verbose & 1 )
+     fprintf(diag, "%d words written out to %s%s (%d pages changed)\n",
+	     STORE_SIZE, storePath, storeBinary ? " (binary)" : "", pages);
 }
 
 
 /**********************************************************/
-/*                      DIAGNOSTICS                       */
-/**********************************************************/
+/*                       CHECKPOINTS                      */
+/**********************************************************/
+
+
+/* A checkpoint holds everything needed to carry on a run exactly as if it had
+   never stopped: registers, store, counts, positions reached on the paper tape
+   and teletype files and the plotter.  It is taken between instructions and
+   written atomically so there is always a complete checkpoint to go back to.
+   On restoring, the same reader, punch and teletype input files must be given
+   as for the original run; the punch file is cut back to where it had got to. */
+
+INT64 filePosition (FILE *f) { // position in device file, -1 => not open
+  if  ( f == NULL ) return -1;
+  fflush(f);
+  return ftell(f);
+}
+
+void saveState () {
+  if  ( (checkpointEvery > 0) && (iCount >= nextCheckpoint) )
+    {
+      writeCheckpoint();
+      nextCheckpoint = iCount + checkpointEvery;
+    }
+  if  ( (recordEvery > 0) && (iCount >= nextSnapshot) )
+    {
+      takeSnapshot();
+      nextSnapshot = iCount + recordEvery;
+    }
+  nextSave = INT64_MAX;
+  if  ( checkpointEvery > 0 ) nextSave = nextCheckpoint;
+  if  ( (recordEvery > 0) && (nextSnapshot < nextSave) ) nextSave = nextSnapshot;
+}
+
+void captureState (CHECKPOINT *c) {
+  memset(c, 0, sizeof(*c));
+  memcpy(c->magic, CHECKPOINT_MAGIC, 4);
+  c->version     = CHECKPOINT_VERSION;
+  c->aReg        = aReg;
+  c->qReg        = qReg;
+  c->bReg        = bReg;
+  c->scReg       = scReg;
+  c->level       = level;
+  c->lastttych   = lastttych;
+  c->punchCount  = punchCount;
+  c->ttyCount    = ttyCount;
+  c->iCount      = iCount;
+  c->emTime      = emTime;
+  memcpy(c->fCount, fCount, sizeof(c->fCount));
+  c->ptrPos      = ( ptrData != NULL ) ? ptrPos : -1;
+  c->punPos      = filePosition(punFile);
+  c->ttyiPos     = filePosition(ttyiFile);
+  fflush(ttyoFile);
+  if  ( plotterTiles != NULL )
+    {
+      c->paperWidth  = plotterPaperWidth;
+      c->paperHeight = plotterPaperHeight;
+    }
+  c->penX        = plotterPenX;
+  c->penY        = plotterPenY;
+  c->penDown     = plotterPenDown;
+  c->ttyOutCount = ttyOutCount;
+  c->plotterSteps = plotterSteps;
+  if  ( (vectorPath != NULL) && (vertexCount > 1) )
+    writeVectors(FALSE); // strokes so far into file, leaving only the pen position
+  c->vectorPos   = ( vectorFile != NULL ) ? vectorEnd : -1;
+  c->vectorStrokes = vectorStrokes;
+  c->vertexDown  = ( vertexCount > 0 ) ? vertices[vertexCount-1].down : -1;
+  c->checksum    = storeChecksum(store, STORE_SIZE);
+}
+
+INT32 saveCheckpoint (char *path, CHECKPOINT *c, INT32 *words, unsigned char **tiles) {
+  // write checkpoint atomically, tiles NULL => blank paper, returns FALSE if fails
+  char tmpPath[strlen(path) + 5];
+  FILE *f;
+  sprintf(tmpPath, "%s.tmp", path);
+  if  ( (f = fopen(tmpPath, "wb")) == NULL )
+    {
+      fprintf(stderr, "*** Cannot open checkpoint file ");
+      perror(tmpPath);
+      return FALSE;
+    }
+  fwrite(c, sizeof(*c), 1, f);
+  fwrite(words, sizeof(INT32), STORE_SIZE, f);
+  if  ( c->paperWidth > 0 )
+    { // each tile as a flag byte, followed by its contents if not blank
+      INT32 tiles2 = ((c->paperWidth  + TILE_SIZE - 1) / TILE_SIZE) *
+	             ((c->paperHeight + TILE_SIZE - 1) / TILE_SIZE);
+      for ( INT32 t = 0 ; t < tiles2 ; t++ )
+	if  ( (tiles != NULL) && (tiles[t] != NULL) )
+	  {
+	    fputc(1, f);
+	    fwrite(tiles[t], 1, TILE_BYTES, f);
+	  }
+	else
+	  fputc(0, f);
+    }
+  if  ( closeSynced(f) || rename(tmpPath, path) )
+    {
+      fprintf(stderr, "*** Error while writing ");
+      perror(path);
+      remove(tmpPath);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+void writeCheckpoint () {
+  CHECKPOINT c;
+  captureState(&c);
+  drawStrokes(); // paper must be up to date
+  if  ( !saveCheckpoint(CHECKPOINT_FILE, &c, store, plotterTiles) )
+    tidyExit(EXIT_FAILURE);
+  if  ( (plotterTiles != NULL) && !serving )
+    writePlot(); // plotter output so far survives too
+  if  ( verbose & 1 )
+    fprintf(diag, "Machine state after %lld instructions saved in %s\n",
+	    (long long) iCount, CHECKPOINT_FILE);
+}
+
+FILE *restoreFile (char *path, char *mode, INT64 pos) { // reopen device file at pos
+  FILE *f;
+  if  ( pos < 0 ) return NULL; // opened when first used
+  if  ( ((f = fopen(path, mode)) == NULL) || (fseek(f, pos, SEEK_SET) != 0) )
+    {
+      fprintf(stderr, "*** Cannot restore position %lld in ", (long long) pos);
+      perror(path);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  return f;
+}
+
+void readCheckpoint () {
+  CHECKPOINT c;
+  FILE *f = fopen(restorePath, "rb");
+  if  ( f == NULL )
+    {
+      fprintf(stderr, "*** Cannot open checkpoint file ");
+      perror(restorePath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  if  ( (fread(&c, sizeof(c), 1, f) != 1) ||
+	(memcmp(c.magic, CHECKPOINT_MAGIC, 4) != 0) || (c.version != CHECKPOINT_VERSION) ||
+	(fread(store, sizeof(INT32), STORE_SIZE, f) != STORE_SIZE) ||
+	(storeChecksum(store, STORE_SIZE) != c.checksum) )
+    {
+      fprintf(stderr, "*** Format error in checkpoint file %s\n", restorePath);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  storeValid = TRUE;
+  resetCaches();
+  aReg        = c.aReg;
+  qReg        = c.qReg;
+  bReg        = c.bReg;
+  scReg       = c.scReg;
+  level       = c.level;
+  lastttych   = c.lastttych;
+  punchCount  = c.punchCount;
+  ttyCount    = c.ttyCount;
+  iCount      = c.iCount;
+  emTime      = c.emTime;
+  memcpy(fCount, c.fCount, sizeof(c.fCount));
+  if  ( c.ptrPos >= 0 )
+    {
+      openTape();
+      if  ( c.ptrPos > ptrLength )
+	{
+	  fprintf(stderr, "*** Cannot restore position %lld in %s\n", (long long) c.ptrPos, ptrPath);
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+      ptrPos = c.ptrPos;
+    }
+  ttyiFile    = restoreFile(ttyInPath, "rb", c.ttyiPos);
+  if  ( (punFile = restoreFile(punPath, "r+b", c.punPos)) != NULL )
+    {
+      ftruncate(fileno(punFile), c.punPos); // discard output since checkpoint
+      bufferOutput(punFile);
+    }
+  if  ( c.paperWidth > 0 )
+    {
+      plotterPaperWidth  = c.paperWidth;
+      plotterPaperHeight = c.paperHeight;
+      setupPlotter();
+      for ( INT32 t = 0 ; t < plotterTilesAcross * plotterTilesDown ; t++ )
+	{
+	  INT32 used = fgetc(f);
+	  if  ( (used == EOF) || (plotterTiles == NULL) ||
+		(used && (((plotterTiles[t] = malloc(TILE_BYTES)) == NULL) ||
+			  (fread(plotterTiles[t], 1, TILE_BYTES, f) != TILE_BYTES))) )
+	    {
+	      fprintf(stderr, "*** Cannot restore plotter paper from %s\n", restorePath);
+	      exit(EXIT_FAILURE);
+	      /* NOT REACHED */
+	    }
+	}
+    }
+  plotterPenX    = c.penX;
+  plotterPenY    = c.penY;
+  plotterPenDown = c.penDown;
+  ttyOutCount    = c.ttyOutCount;
+  plotterSteps   = c.plotterSteps;
+  if  ( plotEvery > 0 ) nextPlot = (plotterSteps / plotEvery + 1) * plotEvery;
+  if  ( vectorPath != NULL )
+    {
+      vectorStrokes = c.vectorStrokes;
+      if  ( c.vectorPos >= 0 )
+	{ // cut back to the checkpoint, leaving the trailer to be written again
+	  if  ( ((vectorFile = fopen(vectorPath, "r+")) == NULL) ||
+		(ftruncate(fileno(vectorFile), c.vectorPos) != 0) ||
+		(fseek(vectorFile, 0, SEEK_END) != 0) )
+	    {
+	      fprintf(stderr, "*** Cannot restore position %lld in ", (long long) c.vectorPos);
+	      perror(vectorPath);
+	      exit(EXIT_FAILURE);
+	      /* NOT REACHED */
+	    }
+	  vectorEnd = c.vectorPos;
+	}
+      if  ( c.vertexDown >= 0 ) recordStroke(c.vertexDown); // pen position
+    }
+  fclose(f);
+  if  ( verbose & 1 )
+    fprintf(diag, "Machine state after %lld instructions restored from %s\n",
+	    (long long) iCount, restorePath);
+}
+
+
+/* In record mode every write to the store is logged with the instruction that
+   made it and the previous contents, and a snapshot of the machine state, less
+   plotter paper, is kept in memory every -record instructions.  -whowrote lists
+   the last writes to a location and -rewind writes a checkpoint from the last
+   snapshot at or before an instruction count, from which -restore can re-run
+   with tracing up to that instruction.  Both apply at the end of the run. */
+
+void takeSnapshot () {
+  if  ( snapshotCount == snapshotMax )
+    {
+      snapshotMax = snapshotMax ? 2 * snapshotMax : 64;
+      if  ( (snapshots = realloc(snapshots, snapshotMax * sizeof(SNAPSHOT))) == NULL )
+	{
+	  fprintf(stderr, "*** Out of memory for snapshots\n");
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+    }
+  SNAPSHOT *s = &snapshots[snapshotCount++];
+  captureState(&s->state);
+  memcpy(s->words, store, sizeof(s->words));
+}
+
+void logWrite (INT32 addr) {
+  if  ( logLength == logMax )
+    {
+      logMax = logMax ? 2 * logMax : 65536;
+      if  ( (writeLog = realloc(writeLog, logMax * sizeof(WRITELOG))) == NULL )
+	{
+	  fprintf(stderr, "*** Out of memory for store write log\n");
+	  exit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+    }
+  writeLog[logLength++] = (WRITELOG) { iCount, lastSCR, addr, store[addr] };
+}
+
+void reportRecord () {
+  const INT64 upTo = ( rewindTo >= 0 ) ? rewindTo : iCount; // point looked back from
+  if  ( whoWrote >= 0 )
+    { // keep last MAX_WHOWROTE writes up to upTo, and the one after for its new value
+      INT64 found[MAX_WHOWROTE], after = -1;
+      INT32 n = 0;
+      for ( INT64 i = 0 ; i < logLength ; i++ )
+	if  ( writeLog[i].addr == whoWrote )
+	  {
+	    if  ( writeLog[i].iCount > upTo )
+	      {
+		after = i;
+		break;
+	      }
+	    found[n++ % MAX_WHOWROTE] = i;
+	  }
+      fprintf(diag, "Writes to ");
+      printAddr(diag, whoWrote);
+      fprintf(diag, " up to instruction %lld: %d", (long long) upTo, n);
+      if  ( n > MAX_WHOWROTE ) fprintf(diag, ", last %d listed", MAX_WHOWROTE);
+      fputc('\n', diag);
+      for ( INT32 k = ( n > MAX_WHOWROTE ) ? n - MAX_WHOWROTE : 0 ; k < n ; k++ )
+	{
+	  const WRITELOG *w = &writeLog[found[k % MAX_WHOWROTE]];
+	  const INT32 new = ( k + 1 < n ) ? writeLog[found[(k + 1) % MAX_WHOWROTE]].old
+	                  : ( after >= 0 ) ? writeLog[after].old : store[whoWrote];
+	  fprintf(diag, "%10lld   ", (long long) w->iCount);
+	  printAddr(diag, w->scr);
+	  fprintf(diag, "  %+8d (&%06o) -> %+8d (&%06o)\n",
+		  ( w->old >= BIT18 ? w->old - BIT19 : w->old ), w->old,
+		  ( new >= BIT18 ? new - BIT19 : new ), new);
+	}
+    }
+  if  ( rewindTo >= 0 )
+    {
+      INT32 i = snapshotCount - 1;
+      while ( (i > 0) && (snapshots[i].state.iCount > rewindTo) ) i--;
+      SNAPSHOT *s = &snapshots[i];
+      if  ( saveCheckpoint(CHECKPOINT_FILE, &s->state, s->words, NULL) )
+	fprintf(diag, "Machine state after %lld instructions written to %s, "
+		"run with -restore=%s -abandon=%d to reach instruction %d\n",
+		(long long) s->state.iCount, CHECKPOINT_FILE, CHECKPOINT_FILE, rewindTo, rewindTo);
+    }
+}
+
+
+/**********************************************************/
+/*                      DIAGNOSTICS                       */
+/**********************************************************/
 
 
  void printDiagnostics(INT32 instruction, INT32 f, INT32 a) {
@@ -916,7 +3737,7 @@ void writeStore () {
    INT32 an = ( aReg >= BIT18 ? aReg - BIT19 : aReg); 
    INT32 qn = ( qReg >= BIT18 ? qReg - BIT19 : qReg);
    INT32 bn = ( store[bReg] >= BIT18 ? store[bReg] - BIT19 : store[bReg]);
-   fprintf(diag, "%10lld   ", iCount); // instruction count
+   fprintf(diag, "%10lld   ", (long long) iCount); // instruction count
    printAddr(diag, lastSCR);    // SCR and registers
    if   (instruction & BIT18 )
      {
@@ -935,6 +3756,90 @@ void writeStore () {
     fprintf(diag, ")\n");
 }
 
+void printInstruction (FILE *f, INT32 word) { // print word as /f a
+  fprintf(f, "%c%2d %4d", ( word >= BIT18 ) ? '/' : ' ',
+	  (word >> FN_SHIFT) & FN_MASK, word & ADDR_MASK);
+}
+
+void writeProfile () {
+  FILE  *f = fopen(profilePath, "w");
+  INT32  order[STORE_SIZE], n = 0;
+  INT64  total = 0, cumulative = 0;
+  if  ( f == NULL )
+    {
+      fprintf(stderr, "*** Cannot open profile file ");
+      perror(profilePath);
+      return;
+    }
+  for ( INT32 i = 0 ; i < STORE_SIZE ; i++ )
+    {
+      total += execCount[i];
+      if  ( execCount[i] ) order[n++] = i;
+    }
+
+  // hot spots in order of executions
+  profileSortBy = execCount;
+  qsort(order, n, sizeof(INT32), compareCounts);
+  fprintf(f, "Profile of %lld instructions executed at %d addresses\n\n", (long long) total, n);
+  fprintf(f, "Hot spots\n\n");
+  fprintf(f, "Address   Instruction     Executed      %%  Cumul %%       Reads      Writes\n");
+  for ( INT32 i = 0 ; (i < n) && (i < PROFILE_HOT) ; i++ )
+    {
+      const INT32 addr = order[i];
+      cumulative += execCount[addr];
+      printAddr(f, addr);
+      fprintf(f, "    ");
+      printInstruction(f, store[addr]);
+      fprintf(f, " %12lld %6.2f %6.2f %11lld %11lld\n", (long long) execCount[addr],
+	      100.0 * execCount[addr] / total, 100.0 * cumulative / total,
+	      (long long) readCount[addr], (long long) writeCount[addr]);
+    }
+
+  // most used operands
+  n = 0;
+  for ( INT32 i = 0 ; i < STORE_SIZE ; i++ )
+    if  ( readCount[i] || writeCount[i] ) order[n++] = i;
+  for ( INT32 pass = 0 ; pass < 2 ; pass++ )
+    {
+      profileSortBy = ( pass == 0 ) ? readCount : writeCount;
+      qsort(order, n, sizeof(INT32), compareCounts);
+      fprintf(f, "\nMost %s\n\n", ( pass == 0 ) ? "read" : "written");
+      fprintf(f, "Address      Content         Reads      Writes\n");
+      for ( INT32 i = 0 ; (i < n) && (i < PROFILE_HOT) && profileSortBy[order[i]] ; i++ )
+	{
+	  const INT32 addr = order[i];
+	  printAddr(f, addr);
+	  fprintf(f, " %+12d %11lld %11lld\n",
+		  ( store[addr] >= BIT18 ) ? store[addr] - BIT19 : store[addr],
+		  (long long) readCount[addr], (long long) writeCount[addr]);
+	}
+    }
+
+  // every word used, in address order
+  fprintf(f, "\nStore\n\n");
+  fprintf(f, "Address   Instruction      Content     Executed       Reads      Writes\n");
+  for ( INT32 addr = 0 ; addr < STORE_SIZE ; addr++ )
+    if  ( execCount[addr] || readCount[addr] || writeCount[addr] )
+      {
+	printAddr(f, addr);
+	fprintf(f, "    ");
+	printInstruction(f, store[addr]);
+	fprintf(f, " %+12d %12lld %11lld %11lld\n",
+		( store[addr] >= BIT18 ) ? store[addr] - BIT19 : store[addr],
+		(long long) execCount[addr], (long long) readCount[addr],
+		(long long) writeCount[addr]);
+      }
+  fclose(f);
+  if  ( verbose & 1 ) fprintf(diag, "Profile written to %s\n", profilePath);
+}
+
+INT32 compareCounts (const void *a, const void *b) { // descending count, then address
+  const INT32 x = *(const INT32 *) a, y = *(const INT32 *) b;
+  if  ( profileSortBy[x] != profileSortBy[y] )
+    return ( profileSortBy[x] > profileSortBy[y] ) ? -1 : 1;
+  return x - y;
+}
+
 void printTime (INT64 us) { // print out time in us
    INT32 hours, mins; float secs;
    hours = us / 360000000L;
@@ -951,17 +3856,30 @@ void printTime (INT64 us) { // print out time in us
 /* Exit and tidy up */
  
 void tidyExit (INT32 reason) {
+  if  ( (reason == EXIT_FAILURE) || (reason == EXIT_LIMITSTOP) ) writeHistory();
+  if  ( jobStage )
+    { // end of job stage rather than of run
+      jobExitCode = reason;
+      longjmp(jobEnv, 1);
+      /* NOT REACHED */
+    }
   if ( storeValid )
     {
       flushTTY();
       writeStore(); // save store for next run
-      if   ( verbose & 1 )
-	fprintf(diag, "Copying over residual input to %s\n", RDR_FILE);
-      if  ( ptrFile  != NULL )
+      if  ( keepTape )
 	{
-	  INT32 ch;
-	  FILE *ptrFile2 = fopen(RDR_FILE, "wb");
-	  if  ( ptrFile2 == NULL )
+	  if  ( ptrData != NULL ) writeTapeOffset();
+	}
+      else if   ( verbose & 1 )
+	fprintf(diag, "Copying over residual input to %s\n", RDR_FILE);
+      if  ( (ptrData != NULL) && !keepTape )
+	{ // replaced by rename as the tape may be mapped from RDR_FILE
+	  const char *tmpPath = RDR_FILE ".tmp";
+	  FILE *ptrFile2 = fopen(tmpPath, "wb");
+	  if  ( (ptrFile2 == NULL) ||
+		(fwrite(ptrData + ptrPos, 1, ptrLength - ptrPos, ptrFile2) != ptrLength - ptrPos) ||
+		closeSynced(ptrFile2) || rename(tmpPath, RDR_FILE) )
 	    {
 	      fprintf(stderr, "*** Unable to save paper tape to %s", RDR_FILE);
 	      perror("");
@@ -969,14 +3887,26 @@ void tidyExit (INT32 reason) {
 	      exit(EXIT_FAILURE);
 	      /* NOT REACHED */
 	    }
-	  while ( (ch = fgetc(ptrFile)) != EOF ) fputc(ch, ptrFile2);
-	  fclose(ptrFile2);
 	}
     }
-  if ( ptrFile      != NULL ) fclose(ptrFile);
+  if ( ttyoFile     != NULL ) fflush(ttyoFile);
+  if ( ptrData      != NULL ) closeTape();
   if ( ttyiFile     != NULL ) fclose(ttyiFile);
-  if ( punFile      != NULL ) fclose(punFile);
-  if ( plotterPaper != NULL ) savePlotterPaper();
+  if ( (punFile != NULL) && fclose(punFile) ) // buffered output written here
+    {
+      fprintf(stderr, "*** Problem writing to ");
+      perror(punPath);
+      reason = EXIT_FAILURE;
+    }
+  if ( plotterTiles != NULL ) savePlotterPaper();
+  if ( (vectorPath != NULL) && (vertexCount > 0) ) writeVectors(TRUE);
+  if ( profilePath  != NULL ) writeProfile();
+  if ( recordEvery  >  0    ) reportRecord();
+  if ( traceFile    != NULL )
+    {
+      flushTrace();
+      fclose(traceFile);
+    }
   if ( diag         != stderr ) fclose(diag);
 
   if ( verbose & 1 ) fprintf(diag, "Exiting %d\n", reason);
@@ -991,15 +3921,10 @@ void tidyExit (INT32 reason) {
 
 void setupPlotter (void)
 {
-    INT32 paperSize = 3*plotterPaperWidth*plotterPaperHeight; 
-    // Using 24bit R,G,B so 3 bytes per pixel.
-    plotterPaper = malloc(paperSize);
-
-    if  ( plotterPaper != NULL )
-    {
-	// Set to all 0xFF for white paper.
-        memset(plotterPaper,0xFF,paperSize);
-    }
+    plotterTilesAcross = (plotterPaperWidth  + TILE_SIZE - 1) / TILE_SIZE;
+    plotterTilesDown   = (plotterPaperHeight + TILE_SIZE - 1) / TILE_SIZE;
+    // No tiles allocated, so all white paper.
+    plotterTiles = calloc(plotterTilesAcross * plotterTilesDown, sizeof(unsigned char *));
     plotterPenX = 1500;
     plotterPenY = plotterPaperHeight-200;
     plotterPenDown = FALSE;
@@ -1009,91 +3934,235 @@ void setupPlotter (void)
 
 void savePlotterPaper (void)
 {
-    char *title = "Elliott 903 Plotter Output";
-    INT32 y;
+    static Bytef signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    static char text[] = "Title\0Elliott 903 Plotter Output";
+    Bytef header[13], zlibHeader[2] = { 0x78, 0x9C }, adler[4];
+    INT32 bands = (plotterPaperHeight + BAND_ROWS - 1) / BAND_ROWS;
+    INT32 threads = sysconf(_SC_NPROCESSORS_ONLN), failed = FALSE, tilesUsed = 0;
+    BAND band[bands];
+    pthread_t thread[threads > 0 ? threads : 1];
+    uLong check = adler32(0, NULL, 0);
+    char tmpPath[strlen(plotPath) + 5];
     FILE *fp;
-    png_structp png_ptr;
-    png_infop info_ptr;
 
-    if  ( plotterPaper == NULL ) return;
-    
-	// Open file for writing (binary mode)
-	fp = fopen(plotPath, "wb");
+    if  ( plotterTiles == NULL ) return;
+    drawStrokes();
+
+	// Open file for writing (binary mode), replacing plotPath only once complete
+	sprintf(tmpPath, "%s.tmp", plotPath);
+	fp = ( plotStream != NULL ) ? plotStream : fopen(tmpPath, "wb");
 	if  ( fp == NULL ) {
 		fprintf(stderr, ERR_FOPEN_PLOT_FILE);
-		perror(plotPath);
-		goto finalise;
+		perror(tmpPath);
+		return;
 	}
 
-	// Initialize write structure
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if  (png_ptr == NULL ) {
-		fprintf(stderr, "Could not allocate PNG write struct\n");
-		goto finalise;
+	// Filter and compress bands of rows in parallel
+	for ( INT32 i = 0 ; i < bands ; i++ ) {
+		band[i].first = i * BAND_ROWS;
+		band[i].last  = ( i == bands-1 ) ? plotterPaperHeight-1 : band[i].first + BAND_ROWS-1;
+		band[i].data  = NULL;
 	}
-
-	// Initialize info structure
-	info_ptr = png_create_info_struct(png_ptr);
-	if ( info_ptr == NULL ) {
-		fprintf(stderr, "Could not allocate PNG info struct\n");
-		goto finalise;
+	if  ( threads > bands ) threads = bands;
+	if  ( threads < 1 ) threads = 1;
+	BANDWORK work[threads];
+	for ( INT32 t = 0 ; t < threads ; t++ ) {
+		work[t].band   = band;
+		work[t].bands  = bands;
+		work[t].next   = t;
+		work[t].step   = threads;
+		work[t].failed = FALSE;
+		if  ( (t > 0) && (pthread_create(&thread[t], NULL, encodeBands, &work[t]) != 0) )
+			work[t].step = 0; // do it below instead
 	}
-
-	// Setup Exception handling
-	if ( setjmp(png_jmpbuf(png_ptr)) ) {
-		fprintf(stderr, "Error during png creation\n");
-		goto finalise;
+	encodeBands(&work[0]);
+	for ( INT32 t = 1 ; t < threads ; t++ ) {
+		if  ( work[t].step == 0 ) {
+			work[t].step = threads;
+			encodeBands(&work[t]);
+		}
+		else
+			pthread_join(thread[t], NULL);
+		failed |= work[t].failed;
+	}
+	failed |= work[0].failed;
+
+	if  ( failed )
+		fprintf(stderr, "Could not compress plotter output\n");
+	else {
+		// Header (1 bit grey scale, 0 black and 1 white) and title
+		fwrite(signature, 1, 8, fp);
+		for ( INT32 i = 0 ; i < 4 ; i++ ) {
+			header[i]   = plotterPaperWidth  >> (24 - 8*i);
+			header[i+4] = plotterPaperHeight >> (24 - 8*i);
+		}
+		header[8]  = 1; // bit depth
+		header[9]  = 0; // grey scale
+		header[10] = header[11] = header[12] = 0; // deflate, filters, no interlace
+		writeChunk(fp, "IHDR", header, 13);
+		writeChunk(fp, "tEXt", (Bytef *) text, sizeof(text)-1);
+
+		// Image data is one zlib stream made up of the bands in order
+		writeChunk(fp, "IDAT", zlibHeader, 2);
+		for ( INT32 i = 0 ; i < bands ; i++ ) {
+			writeChunk(fp, "IDAT", band[i].data, band[i].length);
+			check = adler32_combine(check, band[i].adler, band[i].raw);
+		}
+		for ( INT32 i = 0 ; i < 4 ; i++ ) adler[i] = check >> (24 - 8*i);
+		writeChunk(fp, "IDAT", adler, 4);
+		writeChunk(fp, "IEND", NULL, 0);
+		if  ( ferror(fp) ) {
+			fprintf(stderr, "Error during png creation\n");
+			failed = TRUE;
+		}
 	}
 
-	png_init_io(png_ptr, fp);
-
-	// Write header (8 bit colour depth)
-	png_set_IHDR(png_ptr, info_ptr, plotterPaperWidth, plotterPaperHeight,
-			8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	if  ( verbose & 1 ) {
+		for ( INT32 t = 0 ; t < plotterTilesAcross * plotterTilesDown ; t++ )
+			if  ( plotterTiles[t] != NULL ) tilesUsed++;
+		fprintf(diag, "%d of %d plotter paper tiles used, PNG compressed in %d bands on %d threads\n",
+			tilesUsed, plotterTilesAcross * plotterTilesDown, bands, threads);
+	}
 
-	// Set title
-	if  ( title != NULL ) {
-		png_text title_text;
-		title_text.compression = PNG_TEXT_COMPRESSION_NONE;
-		title_text.key = "Title";
-		title_text.text = title;
-		png_set_text(png_ptr, info_ptr, &title_text, 1);
+	for ( INT32 i = 0 ; i < bands ; i++ ) free(band[i].data);
+	if  ( ((( plotStream != NULL ) ? fclose(fp) : closeSynced(fp)) != 0) || failed )
+		failed = TRUE;
+	if  ( plotStream != NULL )
+		plotStream = NULL;
+	else if  ( failed )
+		remove(tmpPath);
+	else if  ( rename(tmpPath, plotPath) != 0 ) {
+		fprintf(stderr, ERR_FOPEN_PLOT_FILE);
+		perror(plotPath);
 	}
+}
 
-	png_write_info(png_ptr, info_ptr);
+void paperRow (INT32 y, Bytef *row)
+{
+	unsigned char **tiles = &plotterTiles[(y / TILE_SIZE) * plotterTilesAcross];
+	memset(row, 0xFF, (plotterPaperWidth + 7) / 8); // white paper
+	for ( INT32 t = 0 ; t < plotterTilesAcross ; t++ )
+		if  ( tiles[t] != NULL ) {
+			unsigned char *bits = &tiles[t][(y % TILE_SIZE) * TILE_SIZE / 8];
+			INT32 n = (plotterPaperWidth + 7) / 8 - t * TILE_SIZE / 8;
+			if  ( n > TILE_SIZE / 8 ) n = TILE_SIZE / 8;
+			for ( INT32 i = 0 ; i < n ; i++ )
+				row[t * TILE_SIZE / 8 + i] = ~bits[i];
+		}
+}
 
-	// Write image data
+void *encodeBands (void *arg)
+{
+	BANDWORK *w = arg;
+	for ( ; w->next < w->bands ; w->next += w->step )
+		if  ( !encodeBand(&w->band[w->next]) ) w->failed = TRUE;
+	return NULL;
+}
 
-	for ( y=0 ; y<plotterPaperHeight ; y++ ) {
-		png_write_row(png_ptr, &plotterPaper[y * plotterPaperWidth * 3]);
+INT32 encodeBand (BAND *b)
+{ // deflate filtered rows as a raw stream flushed to a byte boundary, finished if last
+	uLong rowBytes = (plotterPaperWidth + 7) / 8; // one byte per 8 pixels
+	Bytef prior[rowBytes], row[rowBytes], line[rowBytes+1];
+	INT32 final = ( b->last == plotterPaperHeight-1 );
+	z_stream z;
+
+	memset(&z, 0, sizeof(z));
+	if  ( deflateInit2(&z, pngLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+		return FALSE;
+	b->raw    = (b->last - b->first + 1) * (rowBytes + 1);
+	b->length = deflateBound(&z, b->raw) + 16; // room for flush marker
+	b->adler  = adler32(0, NULL, 0);
+	if  ( (b->data = malloc(b->length)) == NULL ) {
+		deflateEnd(&z);
+		return FALSE;
 	}
+	z.next_out  = b->data;
+	z.avail_out = b->length;
+
+	if  ( b->first > 0 )
+		paperRow(b->first - 1, prior);
+	else
+		memset(prior, 0, rowBytes); // no row above first
+	for ( INT32 y = b->first ; y <= b->last ; y++ ) {
+		paperRow(y, row);
+		line[0] = pngFilter;
+		switch ( pngFilter ) { // a is byte to left, up above and c above left
+		case 0: // none
+			memcpy(line+1, row, rowBytes);
+			break;
+		case 1: // sub
+			line[1] = row[0];
+			for ( uLong i = 1 ; i < rowBytes ; i++ ) line[i+1] = row[i] - row[i-1];
+			break;
+		case 2: // up
+			for ( uLong i = 0 ; i < rowBytes ; i++ ) line[i+1] = row[i] - prior[i];
+			break;
+		case 3: // average
+			line[1] = row[0] - (prior[0] >> 1);
+			for ( uLong i = 1 ; i < rowBytes ; i++ )
+				line[i+1] = row[i] - ((row[i-1] + prior[i]) >> 1);
+			break;
+		case 4: // paeth, whichever of a, up and c is nearest a + up - c
+			for ( uLong i = 0 ; i < rowBytes ; i++ ) {
+				INT32 a = ( i > 0 ) ? row[i-1] : 0, up = prior[i];
+				INT32 c = ( i > 0 ) ? prior[i-1] : 0, p = a + up - c;
+				line[i+1] = row[i] - ( (abs(p-a) <= abs(p-up)) && (abs(p-a) <= abs(p-c)) ? a :
+						       (abs(p-up) <= abs(p-c)) ? up : c );
+			}
+			break;
+		}
+		memcpy(prior, row, rowBytes);
+		b->adler   = adler32(b->adler, line, rowBytes+1);
+		z.next_in  = line;
+		z.avail_in = rowBytes+1;
+		if  ( deflate(&z, (y < b->last) ? Z_NO_FLUSH : final ? Z_FINISH : Z_SYNC_FLUSH) ==
+		      Z_STREAM_ERROR )
+			break;
+	}
+	b->length -= z.avail_out;
+	deflateEnd(&z);
+	return ( z.avail_in == 0 ) && ( z.avail_out > 0 );
+}
 
-	// End write
-	png_write_end(png_ptr, NULL);
-
-	finalise:
-	if  ( fp != NULL ) fclose(fp);
-	if  ( info_ptr != NULL ) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-	if  ( png_ptr != NULL ) png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+void writeChunk (FILE *fp, char *type, Bytef *data, uLong length)
+{ // length, type, data and CRC of type and data, all big endian
+	Bytef word[4];
+	uLong crc = crc32(crc32(0, NULL, 0), (Bytef *) type, 4);
+	if  ( length > 0 ) crc = crc32(crc, data, length);
+	for ( INT32 i = 0 ; i < 4 ; i++ ) word[i] = length >> (24 - 8*i);
+	fwrite(word, 1, 4, fp);
+	fwrite(type, 1, 4, fp);
+	if  ( length > 0 ) fwrite(data, 1, length, fp);
+	for ( INT32 i = 0 ; i < 4 ; i++ ) word[i] = crc >> (24 - 8*i);
+	fwrite(word, 1, 4, fp);
+}
 
+INLINE void plotPoint(INT32 x, INT32 y)
+{
+  unsigned char **tile = &plotterTiles[(y / TILE_SIZE) * plotterTilesAcross + x / TILE_SIZE];
+  INT32 bit = (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+  if  ( (*tile == NULL) && ((*tile = calloc(TILE_BYTES, 1)) == NULL) )
+    return; // no room for tile, point lost
+  (*tile)[bit >> 3] |= 0x80 >> (bit & 7); // leftmost pixel in top bit, as in PNG
 }
 
 void movePlotter(INT32 bits)
 {
   static INT32 firstCall = TRUE;
-  INT32 address;
 
-  if  ( firstCall )  // Only try once !
+  if  ( firstCall && (plotterTiles == NULL) )  // Only try once, paper may be restored !
     {
        setupPlotter();
        firstCall = FALSE;
     }
 
-  if  ( plotterPaper == NULL ) return;   // Paper allocation failed.
+  if  ( plotterTiles == NULL ) return;   // Paper allocation failed.
 
   if  ( verbose & 8 ) fprintf(diag, "Plotter code %1o output\n", bits & 63);
 
+  if  ( (vectorPath != NULL) && (vertexCount == 0) )
+    recordStroke(FALSE); // starting point
+
   // hard stop at E and W margins
   if  ( (bits & 1 ) && (plotterPenX < plotterPaperWidth ) ) 
 		     plotterPenX+=1; // East
@@ -1104,49 +4173,249 @@ void movePlotter(INT32 bits)
   if  ( bits & 16 )  plotterPenDown = FALSE;
   if  ( bits & 32 )  plotterPenDown = TRUE;
  
-  if ( plotterPenDown )
+  if  ( vectorPath != NULL )
+    recordStroke(plotterPenDown);
+  else if ( plotterPenDown )
+    inkPen(plotterPenX, plotterPenY);
+
+  if  ( (++plotterSteps == nextPlot) && !serving )
     {
-      for ( INT32 x = plotterPenX-plotterPenSize; x <= plotterPenX+plotterPenSize; x++ )
-	  for ( INT32 y = plotterPenY-plotterPenSize; y <= plotterPenY+plotterPenSize; y++ )
-	    if  ( (y >= 0) && ( y < plotterPaperHeight) ) // trim if outside N and S margins
-	      {
-		address = (y*plotterPaperWidth*3)+(x*3);
-		// Three bytes are for R,G,B.  Set all to zero for black pen.
-		plotterPaper[address++] = 0x0;
-		plotterPaper[address++] = 0x0;
-		plotterPaper[address  ] = 0x0;
-	      }
+      writePlot();
+      nextPlot += plotEvery;
+    }
+}
+
+void inkPen(INT32 penX, INT32 penY)
+{
+  for ( INT32 x = penX-plotterPenSize; x <= penX+plotterPenSize; x++ )
+    for ( INT32 y = penY-plotterPenSize; y <= penY+plotterPenSize; y++ )
+      if  ( (y >= 0) && ( y < plotterPaperHeight) && // trim if outside N and S margins
+	    (x >= 0) && ( x < plotterPaperWidth) )   // or nib over E and W margins
+	plotPoint(x, y);
+}
+
+void recordStroke(INT32 down)
+{ // pen now at plotterPenX, plotterPenY
+  INT32 dx = 0, dy = 0;
+  if  ( vertexCount > 0 )
+    {
+      VERTEX *last = &vertices[vertexCount-1];
+      dx = plotterPenX - last->x;
+      dy = plotterPenY - last->y;
+      if  ( (dx == 0) && (dy == 0) && (last->down || !down) )
+	return; // no movement and nothing new to ink
+      if  ( (vertexCount > vertexDrawn) && (down == last->down) &&
+	    (dx == last->dx) && (dy == last->dy) )
+	{ // one more step in the same direction
+	  last->x = plotterPenX;
+	  last->y = plotterPenY;
+	  return;
+	}
+    }
+  if  ( vertexCount == vertexSize )
+    {
+      vertexSize = ( vertexSize == 0 ) ? 4096 : vertexSize * 2;
+      if  ( (vertices = realloc(vertices, vertexSize * sizeof(VERTEX))) == NULL )
+	{
+	  fprintf(stderr, "*** Cannot allocate space for %d plotter strokes\n", vertexSize);
+	  tidyExit(EXIT_FAILURE);
+	  /* NOT REACHED */
+	}
+    }
+  vertices[vertexCount++] = (VERTEX) {plotterPenX, plotterPenY, down, dx, dy};
+}
+
+void drawStrokes(void)
+{ // each step of a stroke inks the paper under the pen where the step ends
+  if  ( vertexDrawn == 0 ) vertexDrawn = 1; // nothing to draw to the starting point
+  for ( ; vertexDrawn < vertexCount ; vertexDrawn++ )
+    {
+      VERTEX *v = &vertices[vertexDrawn];
+      INT32 x = vertices[vertexDrawn-1].x, y = vertices[vertexDrawn-1].y;
+      if  ( !v->down ) continue;
+      if  ( (v->dx == 0) && (v->dy == 0) ) inkPen(x, y); // pen lowered
+      while ( (x != v->x) || (y != v->y) )
+	{
+	  x += v->dx;
+	  y += v->dy;
+	  inkPen(x, y);
+	}
+    }
+}
+
+void writeVectors(INT32 last)
+{ // append strokes since last time, keeping the file complete, then forget them
+  INT32 svg = ( strlen(vectorPath) >= 4 ) &&
+              ( strcasecmp(vectorPath + strlen(vectorPath) - 4, ".svg") == 0 );
+  INT32 penDown = FALSE;
+  if  ( (vectorFile == NULL) && ((vectorFile = fopen(vectorPath, "w")) == NULL) )
+    {
+      fprintf(stderr, "*** Cannot open plotter vector file ");
+      perror(vectorPath);
+      vectorPath = NULL; // give up recording
+      return;
+    }
+  if  ( ftell(vectorFile) == 0 )
+    {
+      if  ( svg ) // 0.1mm per step, y downwards as on paper
+	fprintf(vectorFile, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%gmm\""
+		" height=\"%gmm\" viewBox=\"0 0 %d %d\">\n",
+		plotterPaperWidth / 10.0, plotterPaperHeight / 10.0,
+		plotterPaperWidth, plotterPaperHeight);
+      else        // 0.025mm plotter units, y upwards
+	fprintf(vectorFile, "IN;SP1;");
+    }
+  else
+    fseek(vectorFile, vectorEnd, SEEK_SET); // overwrite trailer
+  if  ( svg && (vertexCount > 1) )
+    fprintf(vectorFile, "<path fill=\"none\" stroke=\"black\" stroke-width=\"%d\""
+	    " stroke-linecap=\"square\" d=\"", 2 * plotterPenSize + 1);
+  for ( INT32 i = 1 ; i < vertexCount ; i++ )
+    {
+      VERTEX *v = &vertices[i], *from = &vertices[i-1];
+      if  ( !v->down )
+	{
+	  penDown = FALSE;
+	  continue; // pen moved up to here
+	}
+      if  ( svg )
+	{
+	  if  ( !penDown ) fprintf(vectorFile, "\nM%d %d", from->x, from->y);
+	  fprintf(vectorFile, " L%d %d", v->x, v->y);
+	}
+      else
+	{
+	  if  ( !penDown )
+	    fprintf(vectorFile, "\nPU%d,%d;", from->x * 4, (plotterPaperHeight - from->y) * 4);
+	  fprintf(vectorFile, "PD%d,%d;", v->x * 4, (plotterPaperHeight - v->y) * 4);
+	}
+      penDown = TRUE;
+    }
+  if  ( svg && (vertexCount > 1) ) fprintf(vectorFile, "\"/>\n");
+  vectorEnd = ftell(vectorFile);
+  fprintf(vectorFile, svg ? "</svg>\n" : "\nPU;SP0;\n");
+  fflush(vectorFile);
+
+  // only the pen position is needed from now on
+  drawStrokes();
+  if  ( vertexCount > 1 )
+    {
+      vectorStrokes += vertexCount - 1;
+      vertices[0] = vertices[vertexCount-1];
+      vertexCount = vertexDrawn = 1;
+    }
+
+  if  ( last )
+    {
+      if  ( ferror(vectorFile) | fclose(vectorFile) )
+	{
+	  fprintf(stderr, "*** Error while writing ");
+	  perror(vectorPath);
+	}
+      else if  ( verbose & 1 )
+	fprintf(diag, "%lld plotter strokes written to %s\n", (long long) vectorStrokes, vectorPath);
+      vectorFile = NULL;
     }
 }
 
+void writePlot(void)
+{ // write out plotter output so far
+  savePlotterPaper();
+  if  ( vectorPath != NULL ) writeVectors(FALSE);
+  if  ( verbose & 1 )
+    fprintf(diag, "Plotter output after %lld steps written\n", (long long) plotterSteps);
+}
+
 
 /**********************************************************/
 /*                    PAPER TAPE SYSTEM                   */
 /**********************************************************/
 
 
-/* Paper tape reader */
-INT32 readTape() {
-  INT32 ch;
-  if   ( ptrFile == NULL )
+/* Paper tape reader - the whole tape is mapped into memory and read in place */
+void openTape() {
+  struct stat st;
+  const INT32 fd = open(ptrPath, O_RDONLY);
+  if  ( (fd < 0) || (fstat(fd, &st) != 0) )
     {
-      if  ( (ptrFile = fopen(ptrPath, "rb")) == NULL )
-	{
-	  flushTTY();
-          fprintf(stderr,"*** %s ", ERR_FOPEN_RDR_FILE);
-          perror(ptrPath);
-          putchar('\n');
-          tidyExit(EXIT_FAILURE);
-	  /* NOT REACHED */
-        }
-      else if  ( verbose & 1 )
+      flushTTY();
+      fprintf(stderr,"*** %s ", ERR_FOPEN_RDR_FILE);
+      perror(ptrPath);
+      putchar('\n');
+      tidyExit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  ptrLength = st.st_size;
+  ptrTime   = st.st_mtime;
+  ptrPos    = 0;
+  ptrMapped = ( ptrLength > 0 );
+  ptrData   = ptrMapped ? mmap(NULL, ptrLength, PROT_READ, MAP_PRIVATE, fd, 0)
+                        : (unsigned char *) ""; // empty tape cannot be mapped
+  close(fd);
+  if  ( ptrData == MAP_FAILED )
+    {
+      ptrData = NULL;
+      flushTTY();
+      fprintf(stderr,"*** %s ", ERR_FOPEN_RDR_FILE);
+      perror(ptrPath);
+      putchar('\n');
+      tidyExit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  if  ( verbose & 1 )
+    {
+      flushTTY();
+      fprintf(diag, "Paper tape reader file %s opened\n", ptrPath);
+    }
+  if  ( keepTape )
+    { // carry on from where last run got to, if tape still the same
+      char path[strlen(ptrPath) + sizeof(OFFSET_SUFFIX)];
+      long long offset, length, mtime;
+      FILE *f;
+      sprintf(path, "%s%s", ptrPath, OFFSET_SUFFIX);
+      if  ( (f = fopen(path, "r")) != NULL )
 	{
-	  flushTTY();
-	  fprintf(diag, "Paper tape reader file %s opened\n", ptrPath);
+	  if  ( (fscanf(f, "%lld %lld %lld", &offset, &length, &mtime) == 3) &&
+		(length == ptrLength) && (mtime == ptrTime) && (offset <= length) )
+	    {
+	      ptrPos = offset;
+	      if  ( verbose & 1 )
+		fprintf(diag, "Reading %s from offset %lld\n", ptrPath, offset);
+	    }
+	  fclose(f);
 	}
     }
-  if  ( (ch = fgetc(ptrFile)) != EOF )
+}
+
+void writeTapeOffset() {
+  char path[strlen(ptrPath) + sizeof(OFFSET_SUFFIX)];
+  FILE *f;
+  sprintf(path, "%s%s", ptrPath, OFFSET_SUFFIX);
+  if  ( ((f = fopen(path, "w")) == NULL) ||
+	(fprintf(f, "%lld %lld %lld\n", (long long) ptrPos, (long long) ptrLength,
+		 (long long) ptrTime) < 0) || fclose(f) )
+    {
+      fprintf(stderr, "*** Unable to save paper tape offset to ");
+      perror(path);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
+  if   ( verbose & 1 )
+    fprintf(diag, "Offset %lld reached in %s saved in %s\n", (long long) ptrPos, ptrPath, path);
+}
+
+void closeTape() {
+  if  ( ptrMapped ) munmap(ptrData, ptrLength);
+  ptrData   = NULL;
+  ptrMapped = FALSE;
+}
+
+INT32 readTape() {
+  INT32 ch;
+  if   ( ptrData == NULL ) openTape();
+  if  ( ptrPos < ptrLength )
       {
+	ch = ptrData[ptrPos++];
 	if  ( verbose & 8 )
 	  {
 	    flushTTY();
@@ -1176,7 +4445,8 @@ void punchTape(INT32 ch) {
     }
   if  ( punFile == NULL )
     {
-      if  ( (punFile = fopen(punPath, "wb")) == NULL )
+      if  ( (punFile = jobStage ? open_memstream(&punchData, &punchLength)
+	                         : fopen(punPath, "wb")) == NULL )
 	{
 	  flushTTY();
 	  printf("*** %s ", ERR_FOPEN_PUN_FILE);
@@ -1190,6 +4460,7 @@ void punchTape(INT32 ch) {
 	  flushTTY();
 	 fprintf(diag, "Paper tape punch file %s opened\n", punPath);
 	}
+      if  ( !jobStage ) bufferOutput(punFile);
     }
   if  ( fputc(ch, punFile) != ch )
     {
@@ -1243,7 +4514,8 @@ INT32 readTTY() {
 	    traceOne = TRUE;
 	    fprintf(diag, "Read character %d from teletype\n", ch);
 	  }
-	putchar(ch); // local echoing assumed
+	fputc(ch, ttyoFile); // local echoing assumed
+	ttyOutCount++;
         return ch;
       }
     else
@@ -1271,15 +4543,29 @@ void writeTTY(INT32 ch) {
 	fprintf(diag, "(%c)\n", ch2);
     }
     if  ( ch2 != -1 )
-      putchar((lastttych = ch2));
+      {
+	fputc((lastttych = ch2), ttyoFile);
+	ttyOutCount++;
+      }
 }
 
 void flushTTY() {
   if  ( (lastttych != -1) && (lastttych != '\n') )
     {
-      putchar('\n');
+      fputc('\n', ttyoFile);
+      ttyOutCount++;
       lastttych = -1;
     }
+  fflush(ttyoFile); // keep in step with diagnostics
+}
+
+void bufferOutput(FILE *f) { // must be called before anything written to f
+  if  ( setvbuf(f, NULL, (outputBuffer > 0) ? _IOFBF : _IONBF, outputBuffer) != 0 )
+    {
+      fprintf(stderr, "*** Cannot set up output buffer of %d bytes\n", outputBuffer);
+      exit(EXIT_FAILURE);
+      /* NOT REACHED */
+    }
 }
 
 /**********************************************************/
@@ -14,6 +14,9 @@
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define INFILE  ".punch"    // input file
 #define OUTFILE ".ascii"    // output file
@@ -27,6 +30,8 @@
 #define TRUE  1
 #define FALSE 0
 
+#define BUFFER 65536        // characters read or written at a time
+
 #define OPTSTR "i:a:"
 #define USAGE_FMT  "%s [-i inputfile] [-a asciifile]"
 
@@ -35,6 +40,7 @@ extern char *optarg;
 extern int opterr, optind;
 
 void convert (FILE *inFile, FILE *outFile);
+size_t filter (unsigned char *in, size_t n, unsigned char *out);
 
 int main (int argc, char *argv[]) {
   int opt;
@@ -82,20 +88,66 @@ int main (int argc, char *argv[]) {
 }
 
 void convert (FILE *inFile, FILE *outFile) {
-  int i, ch, nlFlag, count = 0;
+  static unsigned char in[BUFFER], out[BUFFER];
+  size_t n, k, count = 0;
+  int nlFlag;
   nlFlag = FALSE; // tracks if input ends with a newline
-  while ( (ch = fgetc(inFile)) != EOF ) {
-      ch = ch&127; // strip off parity bit
-      if ( (ch==10) || (32<=ch && ch<=122) ) { // filter out non-printing characters
-	  fputc(ch,outFile);
-	  count++;
-	  nlFlag = (ch==10);
+  while ( (n = fread(in, 1, BUFFER, inFile)) > 0 ) {
+      k = filter(in, n, out);
+      if ( k > 0 ) {
+	  if ( fwrite(out, 1, k, outFile) != k ) {
+	      perror(ERR_FILE_OUT);
+	      exit(EXIT_FAILURE);
+	      /* NOTREACHED */
+	    }
+	  count += k;
+	  nlFlag = (out[k-1]==10);
 	}
     }
+  if ( ferror(inFile) ) {
+      perror(ERR_FILE_IN);
+      exit(EXIT_FAILURE);
+      /* NOTREACHED */
+    }
   if ( (count > 0) && !nlFlag ) fputc('\n',outFile); // force newline at end of file
+  if ( fclose(outFile) ) {
+      perror(ERR_FILE_OUT);
+      exit(EXIT_FAILURE);
+      /* NOTREACHED */
+    }
   return;
-}   
-    
-	
-      
-  
+}
+
+size_t filter (unsigned char *in, size_t n, unsigned char *out) {
+  // strip off parity bits and filter out non-printing characters, returns
+  // characters left in out, which must have room for n characters
+  size_t i = 0, k = 0;
+#ifdef __SSE2__
+  // sixteen characters at a time, copied straight through if all printing
+  const __m128i mask = _mm_set1_epi8(127), nl = _mm_set1_epi8(10);
+  const __m128i low  = _mm_set1_epi8(31),  high = _mm_set1_epi8(123);
+  for ( ; i + 16 <= n ; i += 16 ) {
+      __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i *) &in[i]), mask);
+      __m128i keep = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+				  _mm_and_si128(_mm_cmpgt_epi8(v, low),
+						_mm_cmplt_epi8(v, high)));
+      int bits = _mm_movemask_epi8(keep);
+      if ( bits == 0xFFFF )
+	{
+	  _mm_storeu_si128((__m128i *) &out[k], v);
+	  k += 16;
+	}
+      else
+	for ( int j = 0 ; j < 16 ; j++ ) {
+	    out[k] = in[i+j] & 127;
+	    k += (bits >> j) & 1;
+	  }
+    }
+#endif
+  for ( ; i < n ; i++ ) {
+      unsigned char ch = in[i] & 127;
+      out[k] = ch; // kept only if printing
+      k += (ch==10) || (32<=ch && ch<=122);
+    }
+  return k;
+}
@@ -25,12 +25,16 @@
 #define HALTCODE "<! HALT !>"
 #define HALTCODELEN 9
 
+#define BUFFER 65536         // characters read or written at a time
+
 #define OPTSTR "i:a:"
 #define USAGE_FMT  "to900text inputfile [outputfile]"
 
 void convert (FILE *inFile, FILE *outFile);
 int addParity (int code);
 
+int parity[256];             // addParity() of each character
+
 int main (int argc, char *argv[]) {
   char *inPath, *outPath = OUTFILE;
   FILE *inFile, *outFile;
@@ -68,26 +72,51 @@ int main (int argc, char *argv[]) {
 
 void convert (FILE *inFile, FILE *outFile) {
   static char haltCode[] = HALTCODE;
-  int ch, i, ptr = -1;
-  while ( (ch = fgetc(inFile) ) != EOF)
-    { if ( ch > 128 ) // ignore non-ASCII codes, e.g, if input is in UTF-8
-	  continue; 
-      if ( ch == haltCode[++ptr] )
-	{ // matching against HALTCODE
-          if ( ptr == HALTCODELEN )
+  static unsigned char in[BUFFER], out[BUFFER + HALTCODELEN + 1];
+  size_t n, i, k = 0;
+  int ch, j, ptr = -1;
+  for ( ch = 0 ; ch < 256 ; ch++ )
+    parity[ch] = addParity(ch);
+  while ( (n = fread(in, 1, BUFFER, inFile)) > 0 )
+    for ( i = 0 ; i < n ; i++ )
+      { ch = in[i];
+	if ( ch > 128 ) // ignore non-ASCII codes, e.g, if input is in UTF-8
+	  continue;
+	if ( ch == haltCode[++ptr] )
+	  { // matching against HALTCODE
+	    if ( ptr == HALTCODELEN )
 	      { // matched to end
-	        ptr =- 1; // reset pointer
-	        fputc(20, outFile);
+		ptr = -1; // reset pointer
+		out[k++] = 20;
 	      }
-	}
-      else
-	{ // match failed, empty buffer and then output character
-	  for ( i = 0 ; i < ptr; i++ )
-	    fputc(addParity(haltCode[i]), outFile);
-	  fputc(addParity(ch), outFile);
-	  ptr =- 1; // reset pointer
-	};
-    };
+	  }
+	else
+	  { // match failed, empty buffer and then output character
+	    for ( j = 0 ; j < ptr; j++ )
+	      out[k++] = parity[(int) haltCode[j]];
+	    out[k++] = parity[ch];
+	    ptr = -1; // reset pointer
+	  };
+	if ( k >= BUFFER )
+	  { // output buffer full
+	    if ( fwrite(out, 1, k, outFile) != k )
+	      { perror(ERR_FILE_OUT);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	      }
+	    k = 0;
+	  }
+      };
+  if ( ferror(inFile) )
+    { perror(ERR_FILE_IN);
+      exit(EXIT_FAILURE);
+      /* NOTREACHED */
+    }
+  if ( (fwrite(out, 1, k, outFile) != k) || fclose(outFile) )
+    { perror(ERR_FILE_OUT);
+      exit(EXIT_FAILURE);
+      /* NOTREACHED */
+    }
   return;
 }
 
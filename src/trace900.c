@@ -0,0 +1,149 @@
+/* Support program for 900 series emulator to print a binary trace */
+/*                                                                 */
+/* trace900 [-i inFile] [-o  outFile]                              */
+/* inFile defaults to .trace                                       */
+/* outFile defaults to standard output                             */
+/*                                                                 */
+/* Input is a trace written by emu900 -tracefile=file, output is   */
+/* in the same form as emu900 prints when tracing with -v4.  In a  */
+/* .history file registers shown as -1 were not remembered and     */
+/* are left out.                                                   */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+
+#define INFILE  ".trace"      // input file
+
+#define ERR_FOPEN_INPUT  "Cannot open input file "
+#define ERR_FOPEN_OUTPUT "Cannot open output file "
+#define ERR_STRDUP       "Unexpected error in strdup in main"
+#define ERR_FILE_IN      "Unexpected error with input file"
+#define ERR_NOT_TRACE    "Input file is not an emu900 trace\n"
+
+#define TRACE_MAGIC   "E9TR"  // must agree with emu900
+#define TRACE_VERSION 1
+#define BUFFER        4096    // records read at a time
+
+#define BIT18 0400000
+#define BIT19 01000000
+
+#define OPTSTR "i:o:"
+#define USAGE_FMT  "%s [-i inputfile] [-o outputfile]"
+
+typedef struct {              // as written by emu900
+  int64_t iCount;
+  int32_t scr, instruction, a;
+  int32_t aReg, qReg, b;
+} TRACE;
+
+extern int errno;
+extern char *optarg;
+extern int opterr, optind;
+
+void printTrace (FILE *inFile, FILE *outFile);
+void printAddr (FILE *f, int32_t addr);
+
+int main (int argc, char *argv[]) {
+  int opt;
+  char *inPath  = INFILE;
+  char *outPath = NULL;
+  FILE *inFile, *outFile = stdout;
+
+  // decode arguments
+  opterr = 0;
+  while ((opt = getopt(argc, argv, OPTSTR)) != EOF)
+
+     switch ( opt ) {
+       case 'i':
+	 if ( !(inPath = strdup(optarg)) ) {
+	   perror(ERR_STRDUP);
+	   exit(EXIT_FAILURE);
+	   /* NOTREACHED */
+	 }
+         break;
+       case 'o':
+	 if ( !(outPath = strdup(optarg)) ) {
+	   perror(ERR_STRDUP);
+	   exit(EXIT_FAILURE);
+	   /* NOTREACHED */;
+	 }
+	 break;
+       }
+
+  // open files
+
+  if ( !(inFile = fopen(inPath, "rb")) ){
+       printf(ERR_FOPEN_INPUT);
+       perror(inPath);
+       exit(EXIT_FAILURE);
+       /* NOTREACHED */
+     }
+  if ( outPath && !(outFile = fopen(outPath, "w")) ){
+       printf(ERR_FOPEN_OUTPUT);
+       perror(outPath);
+       exit(EXIT_FAILURE);
+       /* NOTREACHED */
+     }
+
+  printTrace(inFile, outFile);
+
+  return EXIT_SUCCESS;
+}
+
+void printTrace (FILE *inFile, FILE *outFile) {
+  static TRACE buffer[BUFFER];
+  char magic[4];
+  int32_t version;
+  size_t i, n;
+
+  // check header
+  if ( (fread(magic, 1, 4, inFile) != 4) ||
+       (fread(&version, sizeof(version), 1, inFile) != 1) ||
+       (memcmp(magic, TRACE_MAGIC, 4) != 0) || (version != TRACE_VERSION) ) {
+    fprintf(stderr, ERR_NOT_TRACE);
+    exit(EXIT_FAILURE);
+    /* NOTREACHED */
+  }
+
+  // print records a buffer at a time
+  while ( (n = fread(buffer, sizeof(TRACE), BUFFER, inFile)) > 0 )
+    for ( i = 0 ; i < n ; ++i ) {
+      TRACE *t = &buffer[i];
+      int32_t f  = (t->instruction >> 13) & 15;
+      // extend sign bit for A, Q and B register values
+      int32_t an = ( t->aReg >= BIT18 ? t->aReg - BIT19 : t->aReg);
+      int32_t qn = ( t->qReg >= BIT18 ? t->qReg - BIT19 : t->qReg);
+      int32_t bn = ( t->b    >= BIT18 ? t->b    - BIT19 : t->b);
+      fprintf(outFile, "%10lld   ", (long long) t->iCount);
+      printAddr(outFile, t->scr);
+      if ( t->instruction & BIT18 )
+	fprintf(outFile, f > 9 ? " /" : "  /");
+      else
+	fprintf(outFile, f > 9 ? "  " : "   ");
+      fprintf(outFile, "%d %4d", f, t->a);
+      if ( t->aReg < 0 ) { // registers not remembered
+	fputc('\n', outFile);
+	continue;
+      }
+      fprintf(outFile, " A=%+8d (&%06o) Q=%+8d (&%06o) B=%+7d (",
+	      an, t->aReg, qn, t->qReg, bn);
+      printAddr(outFile, t->b);
+      fprintf(outFile, ")\n");
+    }
+  if ( ferror(inFile) ) {
+    perror(ERR_FILE_IN);
+    exit(EXIT_FAILURE);
+  }
+
+  return;
+}
+
+void printAddr (FILE *f, int32_t addr) { // print out address in module form
+  fprintf(f, "%d^%04d", (addr >> 13) & 7, addr & 8191);
+}